@@ -0,0 +1,297 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <unordered_map>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+
+/* A cache of adjacency lists held to a budget in bytes. Lists are spread over
+ * shards by ID, each with its own lock, and each shard evicts with the CLOCK
+ * algorithm: a hand sweeps the shard's entries, clearing the reference bit of
+ * those used since it last went past and evicting the first one it finds
+ * clear. Lists are handed out through handles that pin them, so a search can
+ * keep reading a list while others are loaded. A shard only goes over its
+ * share of the budget when everything in it is pinned.
+ *
+ * A background thread loads the lists of whatever IDs prefetch() was last
+ * given, which is meant to be the next frontier of a search, so the workers
+ * mostly find them already there.
+ *
+ * Source provides limit(), the highest ID, and fetch(id, vector<uint32_t>&),
+ * which has to be safe to call from several threads. */
+template<typename Source>
+class adjacency_cache {
+	struct entry {
+		uint32_t id;
+		uint32_t pins;
+		bool referenced; // Used since the hand last passed
+		size_t cost; // Bytes charged to the shard
+		std::vector<uint32_t> links;
+	};
+
+	struct shard {
+		boost::mutex lock;
+		std::unordered_map<uint32_t, entry*> entries;
+		std::vector<entry*> ring; // In the hand's order; evicted slots are NULL
+		std::vector<size_t> freeSlots;
+		size_t hand, bytes;
+		uint64_t hits, misses, prefetched, evictions;
+
+		shard() : hand(0), bytes(0), hits(0), misses(0), prefetched(0),
+				evictions(0) {
+		}
+	};
+
+public:
+	struct statistics {
+		uint64_t hits, misses, prefetched, evictions;
+		size_t entries, bytes;
+	};
+
+	// A pinned list. A default handle is an empty list.
+	class handle {
+		friend class adjacency_cache;
+		shard* s;
+		entry* e;
+
+		// The entry has already been pinned for this handle
+		handle(shard* sh, entry* en) : s(sh), e(en) {
+		}
+
+	public:
+		handle() : s(NULL), e(NULL) {
+		}
+
+		handle(const handle& o) : s(o.s), e(o.e) {
+			pin(1);
+		}
+
+		~handle() {
+			pin(-1);
+		}
+
+		handle& operator=(const handle& o) {
+			if(e != o.e) {
+				pin(-1);
+				s = o.s;
+				e = o.e;
+				pin(1);
+			}
+			return *this;
+		}
+
+		const uint32_t* begin() const {
+			return e == NULL ? NULL : e->links.data();
+		}
+
+		const uint32_t* end() const {
+			return e == NULL ? NULL : e->links.data() + e->links.size();
+		}
+
+		size_t size() const {
+			return e == NULL ? 0 : e->links.size();
+		}
+
+	private:
+		void pin(int delta) {
+			if(e == NULL) return;
+			boost::lock_guard<boost::mutex> l(s->lock);
+			e->pins += delta;
+		}
+	};
+	typedef handle list_type;
+
+	// budget is in bytes and is split evenly between 2^shardBits shards
+	adjacency_cache(Source& source, size_t budget, unsigned shardBits = 4) :
+			m_source(source), m_limit(source.limit()), m_shardBits(shardBits),
+			m_shards(new shard[1u << shardBits]),
+			m_shardBudget(budget >> shardBits), m_generation(0), m_stop(false) {
+		m_prefetcher = new boost::thread(prefetcher, this);
+	}
+
+	// Every handle must have been released by now
+	~adjacency_cache() {
+		{
+			boost::lock_guard<boost::mutex> l(m_pendingLock);
+			m_stop = true;
+		}
+		m_pendingCond.notify_one();
+		m_prefetcher->join();
+		delete m_prefetcher;
+		for(unsigned i=0;i < (1u << m_shardBits);i++) {
+			std::vector<entry*>& ring = m_shards[i].ring;
+			for(size_t j=0;j<ring.size();j++) delete ring[j];
+		}
+		delete[] m_shards;
+	}
+
+	uint32_t limit() const {
+		return m_limit;
+	}
+
+	// Find a page's links, reading them from the source if they aren't here
+	handle links(uint32_t id) {
+		if(id == 0 || id > m_limit) return handle();
+		shard& s = shardOf(id);
+		entry* e = NULL;
+		{
+			boost::lock_guard<boost::mutex> l(s.lock);
+			typename std::unordered_map<uint32_t, entry*>::iterator i =
+				s.entries.find(id);
+			if(i != s.entries.end()) {
+				s.hits++;
+				e = i->second;
+				e->referenced = true;
+				e->pins++;
+			} else {
+				s.misses++;
+			}
+		}
+
+		// The shard isn't held while reading, so another thread can get the
+		// same list in first, in which case theirs is used
+		if(e == NULL) {
+			std::vector<uint32_t> list;
+			m_source.fetch(id, list);
+			boost::lock_guard<boost::mutex> l(s.lock);
+			e = insert(s, id, list);
+			e->pins++;
+		}
+		return handle(&s, e);
+	}
+
+	// Start loading these lists in the background, in the given order,
+	// instead of whatever was asked for before. Loading stops once half of
+	// the budget has been read, so a big frontier doesn't evict itself.
+	void prefetch(const std::vector<uint32_t>& ids) {
+		{
+			boost::lock_guard<boost::mutex> l(m_pendingLock);
+			m_pending = ids;
+			m_generation++;
+		}
+		m_pendingCond.notify_one();
+	}
+
+	statistics stats() {
+		statistics st = {0, 0, 0, 0, 0, 0};
+		for(unsigned i=0;i < (1u << m_shardBits);i++) {
+			shard& s = m_shards[i];
+			boost::lock_guard<boost::mutex> l(s.lock);
+			st.hits += s.hits;
+			st.misses += s.misses;
+			st.prefetched += s.prefetched;
+			st.evictions += s.evictions;
+			st.entries += s.entries.size();
+			st.bytes += s.bytes;
+		}
+		return st;
+	}
+
+private:
+	shard& shardOf(uint32_t id) {
+		// Neighbouring IDs go to different shards
+		return m_shards[(id * 2654435761u) >> (32 - m_shardBits)];
+	}
+
+	// Add a list to a locked shard, taking the contents of list, unless it's
+	// already there
+	entry* insert(shard& s, uint32_t id, std::vector<uint32_t>& list) {
+		typename std::unordered_map<uint32_t, entry*>::iterator i =
+			s.entries.find(id);
+		if(i != s.entries.end()) return i->second;
+
+		entry* e = new entry();
+		e->id = id;
+		e->pins = 0;
+		e->referenced = true;
+		e->links.swap(list);
+		e->cost = sizeof(entry) + e->links.capacity() * sizeof(uint32_t) +
+			4 * sizeof(void*); // About what the hash table spends on it
+		evict(s, e->cost);
+
+		if(s.freeSlots.empty()) {
+			s.ring.push_back(e);
+		} else {
+			s.ring[s.freeSlots.back()] = e;
+			s.freeSlots.pop_back();
+		}
+		s.entries[id] = e;
+		s.bytes += e->cost;
+		return e;
+	}
+
+	// Make room for need bytes in a locked shard. Two turns of the hand are
+	// enough to clear every reference bit and then evict, so if it's still
+	// over after that, everything left is pinned.
+	void evict(shard& s, size_t need) {
+		size_t steps = 2 * s.ring.size();
+		while(s.bytes + need > m_shardBudget && steps-- > 0) {
+			if(s.hand >= s.ring.size()) s.hand = 0;
+			entry* e = s.ring[s.hand];
+			if(e != NULL && e->pins == 0) {
+				if(e->referenced) {
+					e->referenced = false;
+				} else {
+					s.entries.erase(e->id);
+					s.bytes -= e->cost;
+					s.ring[s.hand] = NULL;
+					s.freeSlots.push_back(s.hand);
+					s.evictions++;
+					delete e;
+				}
+			}
+			s.hand++;
+		}
+	}
+
+	static void prefetcher(adjacency_cache* c) {
+		std::vector<uint32_t> work, list;
+		size_t ahead = (c->m_shardBudget << c->m_shardBits) / 2;
+		while(true) {
+			uint64_t generation;
+			{
+				boost::unique_lock<boost::mutex> l(c->m_pendingLock);
+				while(c->m_pending.empty() && !c->m_stop)
+					c->m_pendingCond.wait(l);
+				if(c->m_stop) return;
+				work.swap(c->m_pending);
+				c->m_pending.clear();
+				generation = c->m_generation;
+			}
+
+			// Give up on this lot as soon as there's a newer one
+			size_t loaded = 0;
+			for(size_t i=0;i<work.size() && loaded < ahead;i++) {
+				if(c->m_generation != generation || c->m_stop) break;
+				uint32_t id = work[i];
+				if(id == 0 || id > c->m_limit) continue;
+				shard& s = c->shardOf(id);
+				{
+					boost::lock_guard<boost::mutex> l(s.lock);
+					if(s.entries.count(id)) continue;
+				}
+				c->m_source.fetch(id, list);
+				boost::lock_guard<boost::mutex> l(s.lock);
+				loaded += c->insert(s, id, list)->cost;
+				s.prefetched++;
+			}
+		}
+	}
+
+	Source& m_source;
+	uint32_t m_limit;
+	unsigned m_shardBits;
+	shard* m_shards;
+	size_t m_shardBudget;
+
+	boost::thread* m_prefetcher;
+	boost::mutex m_pendingLock;
+	boost::condition_variable m_pendingCond;
+	std::vector<uint32_t> m_pending;
+	boost::atomic<uint64_t> m_generation;
+	boost::atomic<bool> m_stop;
+
+	adjacency_cache(const adjacency_cache&);
+	adjacency_cache& operator=(const adjacency_cache&);
+};
@@ -0,0 +1,152 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <boost/atomic.hpp>
+
+/* An append-only vector that any number of threads can push to while others
+ * read it. Elements live in segments that double in size, so nothing ever
+ * moves once it has been written, and a segment is only allocated when the
+ * first element in it is claimed. Writers claim an index with a fetch_add,
+ * store the element and mark its slot ready. The published size is then
+ * moved over whatever run of ready slots follows it, by whichever writer
+ * gets there, so no writer waits for another. Readers only look at elements
+ * below size(), which are complete. T must be default constructible and
+ * assignable. */
+template<typename T>
+class append_vector {
+	static const unsigned FIRST_BITS = 6; // The first segment holds 64
+	static const unsigned SEGMENTS = 40;
+
+public:
+	class iterator {
+		friend class append_vector;
+		const append_vector* v;
+		size_t i;
+
+		iterator(const append_vector* vec, size_t index) : v(vec), i(index) {
+		}
+
+	public:
+		iterator& operator++() {
+			i++;
+			return *this;
+		}
+
+		bool operator==(const iterator& o) const {
+			return i == o.i;
+		}
+
+		bool operator!=(const iterator& o) const {
+			return i != o.i;
+		}
+
+		T& operator*() const {
+			return v->at(i).value;
+		}
+
+		T* operator->() const {
+			return &v->at(i).value;
+		}
+	};
+
+	append_vector() : m_claimed(0), m_size(0) {
+		for(unsigned s=0;s<SEGMENTS;s++) m_segments[s].store(NULL);
+	}
+
+	~append_vector() {
+		for(unsigned s=0;s<SEGMENTS;s++) delete[] m_segments[s].load();
+	}
+
+	// Append an element and return its index
+	size_t push_back(const T& elem) {
+		size_t i = m_claimed.fetch_add(1, boost::memory_order_relaxed);
+		unsigned s;
+		size_t off;
+		locate(i, s, off);
+		slot& sl = segment(s)[off];
+		sl.value = elem;
+
+		// The flag and the size are sequentially consistent, so a writer that
+		// stops at this slot before it is ready is seen by this one, which
+		// then carries on from there
+		sl.ready.store(true, boost::memory_order_seq_cst);
+		size_t n = m_size.load(boost::memory_order_seq_cst);
+		while(ready(n)) {
+			if(m_size.compare_exchange_weak(n, n + 1, boost::memory_order_seq_cst))
+				n++;
+		}
+		return i;
+	}
+
+	// Number of elements that are complete and can be read
+	size_t size() const {
+		return m_size.load(boost::memory_order_acquire);
+	}
+
+	// i must be below a value size() has returned
+	T& operator[](size_t i) const {
+		return at(i).value;
+	}
+
+	iterator begin() const {
+		return iterator(this, 0);
+	}
+
+	// The end as of now; elements pushed later are past it
+	iterator end() const {
+		return iterator(this, size());
+	}
+
+private:
+	struct slot {
+		T value;
+		boost::atomic<bool> ready;
+
+		slot() : ready(false) {
+		}
+	};
+
+	// Segment s holds indices [64*(2^s - 1), 64*(2^(s+1) - 1))
+	static void locate(size_t i, unsigned& s, size_t& off) {
+		size_t v = i + ((size_t)1 << FIRST_BITS);
+		unsigned top = 63 - __builtin_clzll(v);
+		s = top - FIRST_BITS;
+		off = v - ((size_t)1 << top);
+	}
+
+	// Find segment s, allocating it if this is the first writer to get there
+	slot* segment(unsigned s) {
+		slot* seg = m_segments[s].load(boost::memory_order_acquire);
+		if(seg != NULL) return seg;
+		slot* fresh = new slot[(size_t)1 << (s + FIRST_BITS)];
+		if(m_segments[s].compare_exchange_strong(seg, fresh,
+					boost::memory_order_acq_rel, boost::memory_order_acquire))
+			return fresh;
+		delete[] fresh; // Another writer got there first
+		return seg;
+	}
+
+	slot& at(size_t i) const {
+		unsigned s;
+		size_t off;
+		locate(i, s, off);
+		return m_segments[s].load(boost::memory_order_acquire)[off];
+	}
+
+	// Whether slot i has been written. A slot that has been claimed may not
+	// have a segment yet.
+	bool ready(size_t i) const {
+		unsigned s;
+		size_t off;
+		locate(i, s, off);
+		slot* seg = m_segments[s].load(boost::memory_order_seq_cst);
+		return seg != NULL && seg[off].ready.load(boost::memory_order_seq_cst);
+	}
+
+	boost::atomic<slot*> m_segments[SEGMENTS];
+	boost::atomic<size_t> m_claimed; // Indices handed out to writers
+	boost::atomic<size_t> m_size; // Indices below this are published
+
+	append_vector(const append_vector&);
+	append_vector& operator=(const append_vector&);
+};
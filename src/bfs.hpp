@@ -0,0 +1,386 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include <boost/atomic.hpp>
+
+/* A level-synchronous breadth-first search over a graph of page IDs. Each
+ * level's frontier is handed out to the threads in chunks. A thread claims
+ * an unvisited page by CASing its entry in a dense parent array from 0 to the
+ * page it was reached from, and adds it to a next frontier of its own. A
+ * visited bitmap is checked before the CAS, since it is 32 times smaller and
+ * most links lead to pages that have been seen already. Between levels the
+ * threads' frontiers are joined to make the next one. Page IDs start at 1,
+ * so 0 can mean unvisited.
+ *
+ * Given the reversed graph as well, the search switches direction when that
+ * looks cheaper (Beamer et al., "Direction-Optimizing Breadth-First Search").
+ * Once the frontier's links outnumber 1/alpha of the links of the unvisited
+ * pages, a level is searched bottom up instead: every unvisited page looks
+ * through the pages linking to it for one in the frontier, and stops at the
+ * first. On a small-world graph like Wikipedia's that skips most of the links
+ * of the two or three big levels in the middle. It goes back to top down once
+ * the frontier shrinks below 1/beta of all pages.
+ *
+ * The reversed graph also allows a bidirectional search, which goes forward
+ * from the source and backward from the destination, a level of the smaller
+ * frontier at a time, until a page is reached from both ends. Each side only
+ * gets about half as deep, and the branching factor is raised to that.
+ *
+ * Graph provides limit(), the highest ID, links(id), which returns a
+ * list_type with begin() and end() over uint32_t, and prefetch(ids), which
+ * is told each frontier before it is searched top down. */
+template<typename Graph>
+class parallel_bfs {
+	static const size_t CHUNK = 64; // Frontier pages taken at a time
+	static const size_t BOTTOM_UP_CHUNK = 4096; // IDs taken at a time
+
+	// What each thread finds in a level, padded so that threads don't
+	// share cache lines
+	struct local {
+		std::vector<uint32_t> next;
+		uint64_t edges; // Looked at
+		uint64_t nextEdges; // Leaving the pages in next
+		char pad[64];
+
+		local() : edges(0), nextEdges(0) {
+		}
+	};
+
+	// One direction of a search: the graph it follows and what it has seen
+	struct side {
+		Graph* graph;
+		boost::atomic<uint32_t>* parent; // Where each page was reached from
+		boost::atomic<uint64_t>* visited;
+		std::vector<uint32_t> frontier;
+
+		side() : graph(NULL), parent(NULL), visited(NULL) {
+		}
+	};
+
+public:
+	struct statistics {
+		unsigned levels, bottomUpLevels;
+		uint64_t visited, edges; // Pages claimed and links looked at
+	};
+
+	// The calling thread is one of the threads. reverse is graph with every
+	// link reversed, or NULL to only search forward and top down. An alpha
+	// of 0 never goes bottom up.
+	parallel_bfs(Graph& graph, unsigned threads, Graph* reverse = NULL,
+			unsigned alpha = 4, unsigned beta = 24) : m_graph(graph),
+			m_reverse(reverse), m_bottomUpAllowed(reverse != NULL && alpha > 0),
+			m_alpha(alpha), m_beta(beta < 1 ? 1 : beta),
+			m_limit(graph.limit()), m_threads(threads < 1 ? 1 : threads),
+			m_inFrontier(NULL), m_totalEdges(0), m_local(m_threads),
+			m_start(m_threads), m_done(m_threads), m_stop(false) {
+		allocate(m_forward, &graph);
+		if(m_bottomUpAllowed) {
+			m_inFrontier = new uint64_t[words()];
+			for(uint32_t i=1;i<=m_limit;i++) m_totalEdges += degree(i);
+		}
+		for(unsigned i=1;i<m_threads;i++)
+			m_workers.push_back(new boost::thread(worker, this, i));
+	}
+
+	~parallel_bfs() {
+		m_stop = true;
+		m_start.wait();
+		for(size_t i=0;i<m_workers.size();i++) {
+			m_workers[i]->join();
+			delete m_workers[i];
+		}
+		delete[] m_forward.parent;
+		delete[] m_forward.visited;
+		delete[] m_backward.parent;
+		delete[] m_backward.visited;
+		delete[] m_inFrontier;
+	}
+
+	// Find a shortest path from src to dst, both included, and return
+	// whether there is one
+	bool search(uint32_t src, uint32_t dst, std::vector<uint32_t>& path) {
+		path.clear();
+		memset(&m_stats, 0, sizeof(m_stats));
+		if(src == 0 || src > m_limit || dst == 0 || dst > m_limit) return false;
+
+		reset(m_forward, src);
+		std::vector<uint32_t>& frontier = m_forward.frontier;
+		m_expanding = &m_forward;
+		m_other = NULL;
+		m_dst = dst;
+		m_found = (src == dst);
+		m_stats.visited = 1;
+
+		// Links leaving the frontier, and leaving pages not yet visited
+		uint64_t frontierEdges = 0, unvisitedEdges = 0;
+		if(m_bottomUpAllowed) {
+			frontierEdges = degree(src);
+			unvisitedEdges = m_totalEdges - frontierEdges;
+		}
+		size_t lastSize = 0;
+		m_bottomUp = false;
+
+		while(!m_found && !frontier.empty()) {
+			if(m_bottomUpAllowed) {
+				bool growing = frontier.size() > lastSize;
+				if(!m_bottomUp && growing &&
+						frontierEdges > unvisitedEdges / m_alpha)
+					m_bottomUp = true;
+				else if(m_bottomUp && !growing &&
+						frontier.size() < m_limit / m_beta)
+					m_bottomUp = false;
+			}
+			lastSize = frontier.size();
+			if(m_bottomUp) {
+				memset(m_inFrontier, 0, 8*words());
+				for(size_t i=0;i<frontier.size();i++)
+					m_inFrontier[frontier[i] >> 6] |=
+						(uint64_t)1 << (frontier[i] & 63);
+				m_stats.bottomUpLevels++;
+			}
+			frontierEdges = level();
+			unvisitedEdges -= std::min(unvisitedEdges, frontierEdges);
+		}
+		if(!m_found) return false;
+
+		chain(m_forward, dst, path);
+		std::reverse(path.begin(), path.end());
+		return true;
+	}
+
+	// The same, searching from both ends. Without a reversed graph this is
+	// search().
+	bool searchBidirectional(uint32_t src, uint32_t dst,
+			std::vector<uint32_t>& path) {
+		if(m_reverse == NULL) return search(src, dst, path);
+		path.clear();
+		memset(&m_stats, 0, sizeof(m_stats));
+		if(src == 0 || src > m_limit || dst == 0 || dst > m_limit) return false;
+
+		if(m_backward.parent == NULL) allocate(m_backward, m_reverse);
+		reset(m_forward, src);
+		reset(m_backward, dst);
+		m_bottomUp = false;
+		m_meet = (src == dst) ? src : 0;
+		m_found = (src == dst);
+		m_stats.visited = (src == dst) ? 1 : 2;
+
+		// A page claimed by one side that the other has already seen is on a
+		// shortest path. Neither side has seen a page the other had before
+		// the level, so every such page found in a level makes a path of the
+		// same length, and the level can stop at the first.
+		while(!m_found && !m_forward.frontier.empty() &&
+				!m_backward.frontier.empty()) {
+			bool forward = m_forward.frontier.size() <=
+				m_backward.frontier.size();
+			m_expanding = forward ? &m_forward : &m_backward;
+			m_other = forward ? &m_backward : &m_forward;
+			level();
+		}
+		if(!m_found) return false;
+
+		uint32_t meet = m_meet;
+		chain(m_forward, meet, path);
+		std::reverse(path.begin(), path.end());
+		path.pop_back();
+		chain(m_backward, meet, path);
+		return true;
+	}
+
+	const statistics& stats() const {
+		return m_stats;
+	}
+
+private:
+	size_t words() const {
+		return ((size_t)m_limit >> 6) + 1;
+	}
+
+	void allocate(side& s, Graph* graph) {
+		s.graph = graph;
+		s.parent = new boost::atomic<uint32_t>[(size_t)m_limit + 1];
+		s.visited = new boost::atomic<uint64_t>[words()];
+	}
+
+	// Clear a side and put start in its frontier
+	void reset(side& s, uint32_t start) {
+		for(size_t i=0;i<=m_limit;i++)
+			s.parent[i].store(0, boost::memory_order_relaxed);
+		for(size_t i=0;i<words();i++)
+			s.visited[i].store(0, boost::memory_order_relaxed);
+		s.parent[start].store(start, boost::memory_order_relaxed);
+		s.visited[start >> 6].store((uint64_t)1 << (start & 63),
+				boost::memory_order_relaxed);
+		s.frontier.assign(1, start);
+	}
+
+	// Append the pages from p back to where s started
+	void chain(const side& s, uint32_t p, std::vector<uint32_t>& out) {
+		while(true) {
+			out.push_back(p);
+			uint32_t parent = s.parent[p].load(boost::memory_order_relaxed);
+			if(parent == p) return;
+			p = parent;
+		}
+	}
+
+	// Search one level of the side being expanded, and replace its frontier
+	// with the next. Returns the number of links leaving the new frontier if
+	// the search can go bottom up.
+	uint64_t level() {
+		std::vector<uint32_t>& frontier = m_expanding->frontier;
+		if(!m_bottomUp) m_expanding->graph->prefetch(frontier);
+		m_taken = 0;
+
+		// The barriers order everything the workers do in a level between
+		// the main thread's setup and its joining of the results
+		m_start.wait();
+		expand(0);
+		m_done.wait();
+
+		frontier.clear();
+		uint64_t frontierEdges = 0;
+		for(unsigned i=0;i<m_threads;i++) {
+			local& l = m_local[i];
+			frontier.insert(frontier.end(), l.next.begin(), l.next.end());
+			l.next.clear();
+			m_stats.edges += l.edges;
+			frontierEdges += l.nextEdges;
+			l.edges = l.nextEdges = 0;
+		}
+		m_stats.visited += frontier.size();
+		m_stats.levels++;
+		return frontierEdges;
+	}
+
+	uint64_t degree(uint32_t id) {
+		typename Graph::list_type l = m_graph.links(id);
+		return l.end() - l.begin();
+	}
+
+	static void worker(parallel_bfs* b, unsigned n) {
+		while(true) {
+			b->m_start.wait();
+			if(b->m_stop) return;
+			b->expand(n);
+			b->m_done.wait();
+		}
+	}
+
+	void expand(unsigned n) {
+		if(m_bottomUp) expandBottomUp(n);
+		else expandTopDown(n);
+	}
+
+	// Take chunks of the frontier until there are none left, or until
+	// someone has reached the destination
+	void expandTopDown(unsigned n) {
+		local& out = m_local[n];
+		side& s = *m_expanding;
+		size_t size = s.frontier.size();
+		while(!m_found.load(boost::memory_order_relaxed)) {
+			size_t begin = m_taken.fetch_add(CHUNK, boost::memory_order_relaxed);
+			if(begin >= size) break;
+			size_t end = std::min(size, begin + CHUNK);
+			for(size_t i=begin;i<end;i++) {
+				uint32_t u = s.frontier[i];
+				typename Graph::list_type links = s.graph->links(u);
+				for(const uint32_t* l=links.begin();l != links.end();l++) {
+					uint32_t v = *l;
+					out.edges++;
+					if(v == 0 || v > m_limit) continue;
+					uint64_t bit = (uint64_t)1 << (v & 63);
+					if(s.visited[v >> 6].load(boost::memory_order_relaxed) & bit)
+						continue;
+					uint32_t unclaimed = 0;
+					if(!s.parent[v].compare_exchange_strong(unclaimed, u,
+								boost::memory_order_relaxed))
+						continue;
+					s.visited[v >> 6].fetch_or(bit, boost::memory_order_relaxed);
+					claimed(out, v);
+				}
+			}
+		}
+	}
+
+	// Take ranges of IDs and find a parent in the frontier for each page
+	// in them that hasn't been visited. A range covers whole words of the
+	// visited bitmap, so the page is this thread's alone.
+	void expandBottomUp(unsigned n) {
+		local& out = m_local[n];
+		side& s = m_forward;
+		while(!m_found.load(boost::memory_order_relaxed)) {
+			size_t begin = m_taken.fetch_add(BOTTOM_UP_CHUNK,
+					boost::memory_order_relaxed);
+			if(begin > m_limit) break;
+			size_t end = std::min((size_t)m_limit + 1, begin + BOTTOM_UP_CHUNK);
+			for(size_t v=begin;v<end;v++) {
+				uint64_t word = s.visited[v >> 6].load(boost::memory_order_relaxed);
+				if(word == ~(uint64_t)0) {
+					v |= 63;
+					continue;
+				}
+				uint64_t bit = (uint64_t)1 << (v & 63);
+				if(v == 0 || (word & bit)) continue;
+				typename Graph::list_type links = m_reverse->links(v);
+				for(const uint32_t* l=links.begin();l != links.end();l++) {
+					uint32_t u = *l;
+					out.edges++;
+					if(u == 0 || u > m_limit ||
+							!(m_inFrontier[u >> 6] & ((uint64_t)1 << (u & 63))))
+						continue;
+					s.parent[v].store(u, boost::memory_order_relaxed);
+					s.visited[v >> 6].fetch_or(bit, boost::memory_order_relaxed);
+					claimed(out, v);
+					break;
+				}
+			}
+		}
+	}
+
+	void claimed(local& out, uint32_t v) {
+		out.next.push_back(v);
+		if(m_bottomUpAllowed && m_other == NULL) out.nextEdges += degree(v);
+		if(m_other == NULL) {
+			if(v == m_dst) m_found = true;
+		} else if(m_other->visited[v >> 6].load(boost::memory_order_relaxed) &
+				((uint64_t)1 << (v & 63))) {
+			// The other side is idle, so this page is where they meet
+			uint32_t unset = 0;
+			m_meet.compare_exchange_strong(unset, v);
+			m_found = true;
+		}
+	}
+
+	Graph& m_graph;
+	Graph* m_reverse;
+	bool m_bottomUpAllowed;
+	unsigned m_alpha, m_beta;
+	uint32_t m_limit;
+	unsigned m_threads;
+	uint64_t* m_inFrontier; // Only used bottom up
+	uint64_t m_totalEdges;
+
+	side m_forward, m_backward; // The backward side follows m_reverse
+	side* m_expanding; // Set by the main thread between levels
+	side* m_other; // The side that isn't, when searching from both ends
+	std::vector<local> m_local; // Per thread
+	boost::atomic<size_t> m_taken; // Start of the next chunk
+	uint32_t m_dst;
+	boost::atomic<uint32_t> m_meet; // Where the sides met
+	boost::atomic<bool> m_found;
+	bool m_bottomUp; // Set by the main thread between levels
+	statistics m_stats;
+
+	std::vector<boost::thread*> m_workers;
+	boost::barrier m_start, m_done;
+	bool m_stop; // Read by the workers after m_start
+
+	parallel_bfs(const parallel_bfs&);
+	parallel_bfs& operator=(const parallel_bfs&);
+};
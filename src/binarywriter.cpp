@@ -0,0 +1,191 @@
+#include "binarywriter.hpp"
+#include "bytes.hpp"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+
+using namespace std;
+
+BinaryWriter::BinaryWriter(size_t bufferSize) : m_fd(-1),
+		m_bufferSize(bufferSize), m_buffer(NULL), m_used(0), m_base(0),
+		m_failed(false) {
+}
+
+BinaryWriter::~BinaryWriter() {
+	if(m_fd >= 0) close();
+	delete[] m_buffer;
+}
+
+bool BinaryWriter::open(const char* path) {
+	return reopen(path, 0);
+}
+
+bool BinaryWriter::reopen(const char* path, uint64_t keep) {
+	if(m_fd >= 0) close();
+	int flags = O_WRONLY | O_CREAT | (keep == 0 ? O_TRUNC : 0);
+	m_fd = ::open(path, flags, 0666);
+	if(m_fd < 0) return false;
+	if(keep > 0 && (ftruncate(m_fd, keep) != 0 ||
+				lseek(m_fd, keep, SEEK_SET) != (off_t)keep)) {
+		::close(m_fd);
+		m_fd = -1;
+		return false;
+	}
+	if(m_buffer == NULL) m_buffer = new char[m_bufferSize];
+	m_used = 0;
+	m_base = keep;
+	m_failed = false;
+	m_patches.clear();
+	m_patchData.clear();
+	return true;
+}
+
+bool BinaryWriter::writeAll(const char* data, size_t size) {
+	while(size > 0) {
+		ssize_t n = ::write(m_fd, data, size);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) {
+			m_failed = true;
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+void BinaryWriter::write(const void* data, size_t size) {
+	const char* p = (const char*)data;
+	if(m_used + size > m_bufferSize) {
+		flush();
+
+		// Big blocks go straight to the file
+		if(size >= m_bufferSize) {
+			writeAll(p, size);
+			m_base += size;
+			return;
+		}
+	}
+	memcpy(m_buffer + m_used, p, size);
+	m_used += size;
+}
+
+void BinaryWriter::writeInt8(uint8_t d) {
+	write(&d, 1);
+}
+
+void BinaryWriter::writeInt16(uint16_t d) {
+	d = swap16(d);
+	write(&d, sizeof(d));
+}
+
+void BinaryWriter::writeInt32(uint32_t d) {
+	d = swap32(d);
+	write(&d, sizeof(d));
+}
+
+void BinaryWriter::writeInt64(uint64_t d) {
+	d = swap64(d);
+	write(&d, sizeof(d));
+}
+
+void BinaryWriter::writeInt32Array(const uint32_t* d, size_t n) {
+	// The buffer position needn't be aligned, so swap in a block of our own
+	uint32_t block[4096];
+	while(n > 0) {
+		size_t k = min<size_t>(n, 4096);
+		memcpy(block, d, 4*k);
+		swap32Array(block, k);
+		write(block, 4*k);
+		d += k;
+		n -= k;
+	}
+}
+
+void BinaryWriter::skip(size_t size) {
+	while(size > 0) {
+		if(m_used == m_bufferSize) flush();
+		size_t k = min(size, m_bufferSize - m_used);
+		memset(m_buffer + m_used, 0, k);
+		m_used += k;
+		size -= k;
+	}
+}
+
+void BinaryWriter::patch(uint64_t pos, const void* data, size_t size) {
+	if(pos + size > tell()) {
+		m_failed = true; // Nothing there to patch yet
+		return;
+	}
+	if(pos >= m_base) {
+		memcpy(m_buffer + (pos - m_base), data, size);
+		return;
+	}
+	pending_patch p = {pos, m_patchData.size(), size};
+	m_patchData.insert(m_patchData.end(), (const char*)data,
+			(const char*)data + size);
+	m_patches.push_back(p);
+}
+
+void BinaryWriter::patchInt32(uint64_t pos, uint32_t d) {
+	d = swap32(d);
+	patch(pos, &d, sizeof(d));
+}
+
+bool BinaryWriter::flush() {
+	if(m_fd < 0) return false;
+	if(m_used > 0) {
+		writeAll(m_buffer, m_used);
+		m_base += m_used;
+		m_used = 0;
+	}
+	return !m_failed;
+}
+
+bool BinaryWriter::before(const pending_patch& a, const pending_patch& b) {
+	return a.pos < b.pos;
+}
+
+// Apply the deferred patches in file order. Patches that follow on from each
+// other, such as the entries of an offset table, are gathered into the
+// buffer and written together.
+bool BinaryWriter::applyPatches() {
+	stable_sort(m_patches.begin(), m_patches.end(), before);
+	size_t i = 0;
+	while(i < m_patches.size() && !m_failed) {
+		uint64_t start = m_patches[i].pos;
+		size_t used = 0;
+		for(;i < m_patches.size();i++) {
+			const pending_patch& p = m_patches[i];
+			if(p.pos != start + used) break;
+			if(used > 0 && used + p.size > m_bufferSize) break;
+			if(p.size > m_bufferSize) {
+				// Too big to gather, so write it on its own
+				if(pwrite(m_fd, &m_patchData[p.data], p.size, p.pos) !=
+						(ssize_t)p.size)
+					m_failed = true;
+				i++;
+				break;
+			}
+			memcpy(m_buffer + used, &m_patchData[p.data], p.size);
+			used += p.size;
+		}
+		if(used > 0 && pwrite(m_fd, m_buffer, used, start) != (ssize_t)used)
+			m_failed = true;
+	}
+	m_patches.clear();
+	m_patchData.clear();
+	return !m_failed;
+}
+
+bool BinaryWriter::close() {
+	if(m_fd < 0) return false;
+	flush();
+	applyPatches();
+	if(::close(m_fd) != 0) m_failed = true;
+	m_fd = -1;
+	return !m_failed;
+}
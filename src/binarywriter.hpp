@@ -0,0 +1,80 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/* Sequential file writer with its own large buffer. The position is tracked
+ * in memory, so tell() costs nothing, and bytes that have to be filled in
+ * later are patched rather than sought back to: a patch to data still in
+ * the buffer is applied there, and the rest are kept and applied in one
+ * sorted pass with pwrite when the file is closed. Integers are written
+ * big-endian, like the functions in bytes.hpp. */
+class BinaryWriter {
+public:
+	BinaryWriter(size_t bufferSize = 4<<20);
+	~BinaryWriter();
+
+	// Create or truncate a file
+	bool open(const char* path);
+
+	// Open an existing file and carry on writing after its first keep bytes,
+	// dropping anything after them
+	bool reopen(const char* path, uint64_t keep);
+
+	bool isOpen() const {
+		return m_fd >= 0;
+	}
+
+	uint64_t tell() const {
+		return m_base + m_used;
+	}
+
+	void write(const void* data, size_t size);
+	void writeInt8(uint8_t d);
+	void writeInt16(uint16_t d);
+	void writeInt32(uint32_t d);
+	void writeInt64(uint64_t d);
+	void writeInt32Array(const uint32_t* d, size_t n);
+
+	// Write size zero bytes, to be patched later
+	void skip(size_t size);
+
+	// Overwrite bytes that have already been written. Patches shouldn't
+	// overlap each other.
+	void patch(uint64_t pos, const void* data, size_t size);
+	void patchInt32(uint64_t pos, uint32_t d);
+
+	// Hand the buffer to the kernel, so the file is complete up to tell()
+	// apart from outstanding patches
+	bool flush();
+
+	// Flush, apply the patches and close. Returns false if anything went
+	// wrong since the file was opened.
+	bool close();
+
+	bool failed() const {
+		return m_failed;
+	}
+
+private:
+	struct pending_patch {
+		uint64_t pos;
+		size_t data, size; // Where the bytes are in m_patchData
+	};
+
+	static bool before(const pending_patch& a, const pending_patch& b);
+	bool writeAll(const char* data, size_t size);
+	bool applyPatches();
+
+	int m_fd;
+	size_t m_bufferSize;
+	char* m_buffer;
+	size_t m_used;
+	uint64_t m_base; // File position of the start of the buffer
+	bool m_failed;
+	std::vector<pending_patch> m_patches;
+	std::vector<char> m_patchData;
+
+	BinaryWriter(const BinaryWriter&);
+	BinaryWriter& operator=(const BinaryWriter&);
+};
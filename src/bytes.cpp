@@ -1,5 +1,7 @@
 #include "bytes.hpp"
 
+#include <string.h>
+
 uint16_t swap16(uint16_t x) {
 	return (isBigEndian()) ? x : __builtin_bswap16(x);
 }
@@ -48,3 +50,82 @@ void writeInt64(uint64_t d, FILE* f) {
 	fwrite(&d, sizeof(d), 1, f);
 }
 
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// Reverse the bytes of each uint32 in a 16-byte lane
+#define SWAP32_LANE 3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12
+
+__attribute__((target("avx2")))
+static size_t swapBlockAVX2(const uint32_t* in, uint32_t* out, size_t n) {
+	const __m256i mask = _mm256_setr_epi8(SWAP32_LANE, SWAP32_LANE);
+	size_t i = 0;
+	for(;i+8 <= n;i+=8) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+		_mm256_storeu_si256((__m256i*)(out + i), _mm256_shuffle_epi8(v, mask));
+	}
+	return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t swapBlockSSSE3(const uint32_t* in, uint32_t* out, size_t n) {
+	const __m128i mask = _mm_setr_epi8(SWAP32_LANE);
+	size_t i = 0;
+	for(;i+4 <= n;i+=4) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+		_mm_storeu_si128((__m128i*)(out + i), _mm_shuffle_epi8(v, mask));
+	}
+	return i;
+}
+
+static int simdLevel() {
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) return 2;
+	if(__builtin_cpu_supports("ssse3")) return 1;
+	return 0;
+}
+#endif
+
+// Byte swap n uint32s from in to out, which may be the same array. Returns
+// without doing anything on a big-endian machine.
+static void swapBlock(const uint32_t* in, uint32_t* out, size_t n) {
+	if(isBigEndian()) {
+		if(in != out)
+			for(size_t i=0;i<n;i++) out[i] = in[i];
+		return;
+	}
+	size_t i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+	static const int level = simdLevel();
+	if(level == 2) i = swapBlockAVX2(in, out, n);
+	else if(level == 1) i = swapBlockSSSE3(in, out, n);
+#endif
+	for(;i<n;i++) out[i] = __builtin_bswap32(in[i]);
+}
+
+void swap32Array(uint32_t* d, size_t n) {
+	swapBlock(d, d, n);
+}
+
+void decodeInt32Array(const void* in, uint32_t* out, size_t n) {
+	memcpy(out, in, 4*n);
+	swapBlock(out, out, n);
+}
+
+size_t readInt32Array(FILE* f, uint32_t* out, size_t n) {
+	n = fread(out, sizeof(uint32_t), n, f);
+	swapBlock(out, out, n);
+	return n;
+}
+
+void writeInt32Array(const uint32_t* d, size_t n, FILE* f) {
+	uint32_t buf[4096];
+	while(n > 0) {
+		size_t k = (n < 4096) ? n : 4096;
+		swapBlock(d, buf, k);
+		fwrite(buf, sizeof(uint32_t), k, f);
+		d += k;
+		n -= k;
+	}
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 
 inline bool isBigEndian() {
 	uint16_t x = 0xff00;
@@ -17,3 +18,10 @@ uint64_t readInt64(FILE* f);
 void writeInt16(uint16_t d, FILE* f);
 void writeInt32(uint32_t d, FILE* f);
 void writeInt64(uint64_t d, FILE* f);
+
+// Whole arrays of big-endian uint32s at a time. The byte swap runs over the
+// block with SSSE3 or AVX2 shuffles where the processor has them.
+void swap32Array(uint32_t* d, size_t n);
+void decodeInt32Array(const void* in, uint32_t* out, size_t n);
+size_t readInt32Array(FILE* f, uint32_t* out, size_t n); // Returns the count read
+void writeInt32Array(const uint32_t* d, size_t n, FILE* f);
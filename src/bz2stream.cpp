@@ -0,0 +1,305 @@
+#include "bz2stream.hpp"
+#include "queue.hpp"
+
+#include <string.h>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#include <bzlib.h>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+
+using namespace std;
+
+// Every bzip2 stream starts with "BZh" and a block size digit, followed by the
+// magic number of its first block. Streams are byte-aligned in a multistream
+// file, so this 10-byte pattern marks the places where the input can be cut.
+static const size_t HEADER_LEN = 10;
+static const size_t READ_BLOCK = 1<<20;
+
+static bool isStreamHeader(const char* p) {
+	static const char blockMagic[] = "\x31\x41\x59\x26\x53\x59";
+	return p[0] == 'B' && p[1] == 'Z' && p[2] == 'h' &&
+		p[3] >= '1' && p[3] <= '9' && memcmp(p+4, blockMagic, 6) == 0;
+}
+
+// Find the first stream header in buf[from, len), or return len if none
+static size_t findStreamHeader(const char* buf, size_t from, size_t len) {
+	while(from + HEADER_LEN <= len) {
+		const char* p = (const char*)memchr(buf+from, 'B',
+				len - from - HEADER_LEN + 1);
+		if(p == NULL) break;
+		if(isStreamHeader(p)) return p - buf;
+		from = (p - buf) + 1;
+	}
+	return len;
+}
+
+struct bz2_job {
+	vector<char> in, out;
+	size_t outLen, consumed;
+	uint64_t inEnd; // Compressed offset just past this job
+	uint32_t opened, closed; // Page elements started and ended in the output
+	bool done, error;
+
+	bz2_job() : outLen(0), consumed(0), inEnd(0), opened(0), closed(0),
+			done(false), error(false) {
+	}
+};
+
+// A place where the input could be picked up again
+struct bz2_boundary {
+	uint64_t offset, pages;
+};
+
+struct bz2_parallel_state {
+	FILE* f;
+	size_t jobSize, maxInFlight;
+	boost::mutex lock;
+	boost::condition_variable cond;
+	deque<bz2_job*> inFlight; // Jobs in input order, done or not
+	BoundedQueue<bz2_job*> work;
+	boost::thread* reader;
+	vector<boost::thread*> workers;
+	bool eof, failed;
+	boost::atomic<bool> stop; // Workers check this without the lock
+	uint64_t start;
+
+	// Pages handed out so far, and how many of them are still open
+	uint64_t pages;
+	int64_t open;
+	deque<bz2_boundary> boundaries;
+
+	bz2_parallel_state(FILE* file, int threads, size_t js, uint64_t from) :
+			f(file), jobSize(js), maxInFlight(2*threads + 2),
+			work(2*threads + 2), reader(NULL), eof(false), failed(false),
+			stop(false), start(from), pages(0), open(0) {
+	}
+
+	~bz2_parallel_state() {
+		{
+			boost::lock_guard<boost::mutex> l(lock);
+			stop = true;
+			cond.notify_all();
+		}
+		work.close();
+		if(reader != NULL) {
+			reader->join();
+			delete reader;
+		}
+		for(size_t i=0;i<workers.size();i++) {
+			workers[i]->join();
+			delete workers[i];
+		}
+		for(deque<bz2_job*>::iterator i=inFlight.begin();i != inFlight.end();i++)
+			delete *i;
+		if(f != NULL) fclose(f);
+	}
+
+	// Queue a job for decompression, waiting for room in the window. Returns
+	// false if the source is shutting down.
+	bool submit(bz2_job* job) {
+		{
+			boost::unique_lock<boost::mutex> l(lock);
+			while(inFlight.size() >= maxInFlight && !stop) cond.wait(l);
+			if(stop) {
+				delete job;
+				return false;
+			}
+			inFlight.push_back(job);
+		}
+		work.put(job);
+		return true;
+	}
+};
+
+static uint32_t countTag(const char* buf, size_t len, const char* tag) {
+	size_t tagLen = strlen(tag);
+	uint32_t n = 0;
+	const char* end = buf + len;
+	while(buf < end) {
+		const char* p = (const char*)memchr(buf, '<', end - buf);
+		if(p == NULL || (size_t)(end - p) < tagLen) break;
+		if(memcmp(p, tag, tagLen) == 0) n++;
+		buf = p + 1;
+	}
+	return n;
+}
+
+// Decompress every stream in a job. Fails if the job ends partway through a
+// stream, which would mean the header scan split inside compressed data.
+static bool decompressJob(bz2_job* job) {
+	size_t inPos = 0, inLen = job->in.size();
+	job->out.resize(inLen*6 + 4096);
+	job->outLen = 0;
+	while(inPos < inLen) {
+		if(inLen - inPos < HEADER_LEN || !isStreamHeader(&job->in[inPos]))
+			break; // Trailing padding after the last stream
+
+		bz_stream bz;
+		memset(&bz, 0, sizeof(bz));
+		if(BZ2_bzDecompressInit(&bz, 0, 0) != BZ_OK) return false;
+		bz.next_in = &job->in[inPos];
+		bz.avail_in = inLen - inPos;
+		int ret;
+		do {
+			if(job->outLen == job->out.size())
+				job->out.resize(job->out.size()*2);
+			bz.next_out = &job->out[job->outLen];
+			bz.avail_out = job->out.size() - job->outLen;
+			ret = BZ2_bzDecompress(&bz);
+			job->outLen = job->out.size() - bz.avail_out;
+		} while(ret == BZ_OK && (bz.avail_in > 0 || bz.avail_out == 0));
+		inPos = inLen - bz.avail_in;
+		BZ2_bzDecompressEnd(&bz);
+		if(ret != BZ_STREAM_END) return false;
+	}
+	vector<char>().swap(job->in);
+	job->opened = countTag(&job->out[0], job->outLen, "<page>");
+	job->closed = countTag(&job->out[0], job->outLen, "</page>");
+	return true;
+}
+
+static void bz2ReaderThread(bz2_parallel_state* st) {
+	vector<char> pending;
+	uint64_t pendingStart = st->start; // Offset of pending[0] in the file
+	size_t scanned = 1; // Never cut at the pending job's own header
+	while(true) {
+		size_t old = pending.size();
+		pending.resize(old + READ_BLOCK);
+		size_t n = fread(&pending[old], 1, READ_BLOCK, st->f);
+		pending.resize(old + n);
+		if(n == 0) break;
+
+		// Cut off whole streams once the pending job is big enough
+		while(true) {
+			size_t from = max(scanned, st->jobSize);
+			size_t p = findStreamHeader(&pending[0], from, pending.size());
+			if(p == pending.size()) {
+				if(pending.size() >= HEADER_LEN)
+					scanned = max(from, pending.size() - HEADER_LEN + 1);
+				break;
+			}
+			bz2_job* job = new bz2_job();
+			job->in.assign(pending.begin(), pending.begin()+p);
+			pending.erase(pending.begin(), pending.begin()+p);
+			pendingStart += p;
+			job->inEnd = pendingStart;
+			scanned = 1;
+			if(!st->submit(job)) return;
+		}
+	}
+	if(!pending.empty()) {
+		bz2_job* job = new bz2_job();
+		job->inEnd = pendingStart + pending.size();
+		job->in.swap(pending);
+		if(!st->submit(job)) return;
+	}
+
+	boost::lock_guard<boost::mutex> l(st->lock);
+	st->eof = true;
+	st->cond.notify_all();
+	st->work.close();
+}
+
+static void bz2WorkerThread(bz2_parallel_state* st) {
+	bz2_job* job;
+	while(st->work.get(job)) {
+		bool ok = st->stop || decompressJob(job);
+		boost::lock_guard<boost::mutex> l(st->lock);
+		job->done = true;
+		job->error = !ok;
+		st->cond.notify_all();
+	}
+}
+
+bz2_parallel_source::bz2_parallel_source(const char* path, int threads,
+		size_t jobSize, uint64_t startOffset) {
+	if(threads < 1) threads = 1;
+	FILE* f = fopen(path, "rb");
+	if(f != NULL && fseeko(f, startOffset, SEEK_SET) != 0) {
+		fclose(f);
+		f = NULL;
+	}
+	m_state.reset(new bz2_parallel_state(f, threads, jobSize, startOffset));
+	if(f == NULL) return;
+
+	m_state->reader = new boost::thread(bz2ReaderThread, m_state.get());
+	for(int i=0;i<threads;i++)
+		m_state->workers.push_back(
+				new boost::thread(bz2WorkerThread, m_state.get()));
+}
+
+std::streamsize bz2_parallel_source::read(char* s, std::streamsize n) {
+	bz2_parallel_state* st = m_state.get();
+	if(st->f == NULL) return -1;
+	boost::unique_lock<boost::mutex> l(st->lock);
+	while(!st->failed) {
+		// Wait for the oldest job to finish
+		while(st->inFlight.empty() ? !st->eof : !st->inFlight.front()->done)
+			st->cond.wait(l);
+		if(st->inFlight.empty()) return -1;
+
+		bz2_job* job = st->inFlight.front();
+		if(job->error) {
+			st->failed = true;
+			break;
+		}
+		if(job->consumed < job->outLen) {
+			size_t k = min((size_t)n, job->outLen - job->consumed);
+			if(job->consumed + k == job->outLen) {
+				// This hands out the rest of the job, so what comes next
+				// starts at a stream boundary
+				st->pages += job->opened;
+				st->open += (int64_t)job->opened - job->closed;
+				if(st->open == 0) {
+					bz2_boundary b = {job->inEnd, st->pages};
+					st->boundaries.push_back(b);
+				}
+			}
+
+			// Only this thread touches a finished job, so copy unlocked
+			l.unlock();
+			memcpy(s, &job->out[job->consumed], k);
+			job->consumed += k;
+			return k;
+		}
+
+		// This job is exhausted; drop it and make room for another
+		st->inFlight.pop_front();
+		delete job;
+		st->cond.notify_all();
+	}
+	return -1;
+}
+
+bool bz2_parallel_source::good() const {
+	return m_state->f != NULL;
+}
+
+bool bz2_parallel_source::failed() const {
+	boost::lock_guard<boost::mutex> l(m_state->lock);
+	return m_state->failed;
+}
+
+bool bz2_parallel_source::boundary(uint64_t pages, uint64_t& offset) {
+	boost::lock_guard<boost::mutex> l(m_state->lock);
+	deque<bz2_boundary>& b = m_state->boundaries;
+	while(!b.empty() && b.front().pages < pages) b.pop_front();
+	if(b.empty() || b.front().pages != pages) return false;
+	offset = b.front().offset;
+	b.pop_front();
+	return true;
+}
+
+bool bz2_is_multistream(const char* path, size_t probeBytes) {
+	FILE* f = fopen(path, "rb");
+	if(f == NULL) return false;
+	vector<char> buf(probeBytes);
+	size_t n = fread(&buf[0], 1, probeBytes, f);
+	fclose(f);
+	if(n < HEADER_LEN || !isStreamHeader(&buf[0])) return false;
+	if(n < probeBytes) return true;
+	return findStreamHeader(&buf[0], 1, n) != n;
+}
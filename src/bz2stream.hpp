@@ -0,0 +1,49 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <ios>
+#include <boost/shared_ptr.hpp>
+#include <boost/iostreams/categories.hpp>
+
+struct bz2_parallel_state;
+
+/* A Boost.Iostreams source that decompresses a multistream bzip2 file on
+ * several threads. A reader thread scans the compressed input for stream
+ * headers and cuts it into jobs of one or more whole streams, a pool of
+ * workers decompresses the jobs, and read() hands the output back strictly in
+ * input order. Copies share the same state, so the caller can keep a handle to
+ * check for errors after pushing it onto a filtering_streambuf.
+ *
+ * The source also counts the <page> elements in the output, so it can tell
+ * where in the compressed file the dump could be picked up again after a
+ * given number of pages. */
+class bz2_parallel_source {
+public:
+	typedef char char_type;
+	typedef boost::iostreams::source_tag category;
+
+	// Decompression starts at startOffset, which must be the start of a
+	// stream, such as an offset returned by boundary()
+	bz2_parallel_source(const char* path, int threads,
+			size_t jobSize=1<<20, uint64_t startOffset=0);
+
+	std::streamsize read(char* s, std::streamsize n);
+
+	bool good() const; // False if the file could not be opened
+	bool failed() const; // True if a stream was truncated or corrupt
+
+	// If the output handed out so far ended, at a stream boundary, right
+	// after the given number of pages (counted from the start offset) with
+	// no page left open, return the compressed offset of that boundary.
+	// Boundaries for fewer pages are forgotten, so ask in increasing order.
+	bool boundary(uint64_t pages, uint64_t& offset);
+
+private:
+	boost::shared_ptr<bz2_parallel_state> m_state;
+};
+
+// Returns true if the file looks like a multistream dump, i.e. a second bzip2
+// stream header shows up within the first probeBytes or the whole file fits
+// in that window. Single-stream files can't be split and should be read with
+// the ordinary bzip2_decompressor instead.
+bool bz2_is_multistream(const char* path, size_t probeBytes=32<<20);
@@ -0,0 +1,159 @@
+#include "contentstore.hpp"
+
+#include <stdexcept>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+
+using namespace std;
+namespace io = boost::iostreams;
+
+ContentWriter::ContentWriter(int threads, size_t blockSize) :
+		m_threads(threads < 1 ? 1 : threads), m_blockSize(blockSize),
+		m_current(NULL), m_nBlocks(0), m_raw(2 * m_threads),
+		m_packed(2 * m_threads), m_writer(NULL) {
+}
+
+ContentWriter::~ContentWriter() {
+	if(m_writer != NULL) close();
+	delete m_current;
+}
+
+bool ContentWriter::open(const char* path) {
+	if(!m_file.open(path)) return false;
+	m_file.skip(CONTENT_HEADER_SIZE);
+	for(int i=0;i<m_threads;i++)
+		m_workers.push_back(new boost::thread(compressor, this));
+	m_writer = new boost::thread(writer, this);
+	return true;
+}
+
+void ContentWriter::add(const char* data, size_t size) {
+	// A page isn't split across blocks, so a big one gets a block to itself
+	if(m_current != NULL && m_current->raw.size() > 0 &&
+			m_current->raw.size() + size > m_blockSize)
+		finishBlock();
+	if(m_current == NULL) {
+		m_current = new block();
+		m_current->seq = m_nBlocks++;
+		m_current->raw.reserve(m_blockSize);
+	}
+	m_pages.push_back(m_current->seq);
+	m_pages.push_back(m_current->raw.size());
+	m_pages.push_back(size);
+	m_current->raw.append(data, size);
+}
+
+void ContentWriter::finishBlock() {
+	m_raw.put(m_current);
+	m_current = NULL;
+}
+
+void ContentWriter::compressor(ContentWriter* w) {
+	block* b;
+	while(w->m_raw.get(b)) {
+		io::filtering_ostream out;
+		out.push(io::zlib_compressor());
+		out.push(io::back_inserter(b->packed));
+		out.write(b->raw.data(), b->raw.size());
+		out.reset();
+		w->m_packed.put(b->seq, b);
+	}
+}
+
+void ContentWriter::writer(ContentWriter* w) {
+	block* b;
+	while(w->m_packed.get(b)) {
+		block_entry e = {w->m_file.tell(), (uint32_t)b->packed.size(),
+			(uint32_t)b->raw.size()};
+		w->m_file.write(b->packed.data(), b->packed.size());
+		w->m_blocks.push_back(e);
+		delete b;
+	}
+}
+
+bool ContentWriter::close() {
+	if(m_writer == NULL) return false;
+	if(m_current != NULL) finishBlock();
+
+	// Every block has been compressed once the workers are gone, so the
+	// writer only has to drain what's left
+	m_raw.close();
+	for(size_t i=0;i<m_workers.size();i++) {
+		m_workers[i]->join();
+		delete m_workers[i];
+	}
+	m_workers.clear();
+	m_packed.close();
+	m_writer->join();
+	delete m_writer;
+	m_writer = NULL;
+
+	uint64_t index = m_file.tell();
+	for(size_t i=0;i<m_blocks.size();i++) {
+		m_file.writeInt64(m_blocks[i].offset);
+		m_file.writeInt32(m_blocks[i].packedSize);
+		m_file.writeInt32(m_blocks[i].rawSize);
+	}
+	m_file.writeInt32Array(m_pages.data(), m_pages.size());
+
+	uint32_t nPages = m_pages.size() / 3;
+	m_file.patchInt32(0, CONTENT_MAGIC);
+	m_file.patchInt32(4, nPages);
+	m_file.patchInt32(8, m_blocks.size());
+	m_file.patchInt32(16, index >> 32);
+	m_file.patchInt32(20, index);
+	bool ok = m_blocks.size() == m_nBlocks;
+	return m_file.close() && ok;
+}
+
+bool content_store::open(const char* path) {
+	if(!m_file.map(path)) return false;
+	if(m_file.size < CONTENT_HEADER_SIZE || m_file.int32At(0) != CONTENT_MAGIC)
+		throw runtime_error("Damaged contents.bin");
+	m_count = m_file.int32At(4);
+	m_blocks = m_file.int32At(8);
+	m_index = ((uint64_t)m_file.int32At(16) << 32) | m_file.int32At(20);
+	if(m_index > m_file.size ||
+			16*(uint64_t)m_blocks + 12*(uint64_t)m_count != m_file.size - m_index)
+		throw runtime_error("Damaged contents.bin");
+	m_cached = ~0u;
+	m_file.adviseRandom();
+	return true;
+}
+
+bool content_store::text(uint32_t id, string& out) {
+	if(id == 0 || id > m_count) return false;
+	size_t page = m_index + 16*(size_t)m_blocks + 12*(size_t)(id - 1);
+	uint32_t blk = m_file.int32At(page);
+	uint32_t offset = m_file.int32At(page + 4);
+	uint32_t length = m_file.int32At(page + 8);
+	if(blk >= m_blocks) return false;
+
+	if(blk != m_cached) {
+		size_t entry = m_index + 16*(size_t)blk;
+		uint64_t start = ((uint64_t)m_file.int32At(entry) << 32) |
+			m_file.int32At(entry + 4);
+		uint32_t packedSize = m_file.int32At(entry + 8);
+		uint32_t rawSize = m_file.int32At(entry + 12);
+		if(start > m_index || packedSize > m_index - start) return false;
+
+		m_cached = ~0u;
+		m_block.resize(rawSize);
+		try {
+			io::filtering_istream in;
+			in.push(io::zlib_decompressor());
+			in.push(io::array_source((const char*)m_file.data + start,
+					packedSize));
+			in.read(&m_block[0], rawSize);
+			if((uint32_t)in.gcount() != rawSize) return false;
+		} catch(io::zlib_error& e) {
+			return false;
+		}
+		m_cached = blk;
+	}
+	if((uint64_t)offset + length > m_block.size()) return false;
+	out.assign(m_block, offset, length);
+	return true;
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+
+#include "mapfile.hpp"
+#include "binarywriter.hpp"
+#include "queue.hpp"
+
+/* Article text, in contents.bin. Pages are packed in ID order into blocks of
+ * about blockSize bytes, and each block is compressed with zlib on its own, so
+ * reading a page only inflates the one block it is in. The file is big-endian
+ * like the version 1 tables:
+ *	magic "WMCT", page count, block count, 0, uint64 offset of the index
+ *	the compressed blocks, one after another
+ *	per block: uint64 offset, uint32 compressed size, uint32 inflated size
+ *	per page from ID 1: uint32 block, uint32 offset in the inflated block,
+ *		uint32 length */
+#define CONTENT_MAGIC 0x574d4354u // "WMCT"
+#define CONTENT_HEADER_SIZE 24
+
+/* Writes contents.bin. Blocks are compressed on a pool of threads while the
+ * caller carries on adding pages, and written out in order by another. */
+class ContentWriter {
+public:
+	ContentWriter(int threads, size_t blockSize = 256<<10);
+	~ContentWriter();
+
+	bool open(const char* path);
+
+	// Add the text of the next page. Pages without any are added empty.
+	void add(const char* data, size_t size);
+
+	// Wait for the outstanding blocks and write the index. Returns false if
+	// anything went wrong.
+	bool close();
+
+private:
+	struct block {
+		uint64_t seq;
+		std::string raw, packed;
+	};
+
+	struct block_entry {
+		uint64_t offset;
+		uint32_t packedSize, rawSize;
+	};
+
+	void finishBlock();
+	static void compressor(ContentWriter* w);
+	static void writer(ContentWriter* w);
+
+	int m_threads;
+	size_t m_blockSize;
+	BinaryWriter m_file;
+	block* m_current;
+	uint64_t m_nBlocks;
+	std::vector<uint32_t> m_pages; // Three entries per page, as in the file
+	std::vector<block_entry> m_blocks; // Filled in by the writer thread
+
+	BoundedQueue<block*> m_raw;
+	OrderedQueue<block*> m_packed;
+	std::vector<boost::thread*> m_workers;
+	boost::thread* m_writer;
+
+	ContentWriter(const ContentWriter&);
+	ContentWriter& operator=(const ContentWriter&);
+};
+
+/* Reads pages from a mapped contents.bin. The last block inflated is kept, as
+ * pages next to each other are often wanted together. */
+class content_store {
+public:
+	content_store() : m_count(0), m_blocks(0), m_cached(~0u) {
+	}
+
+	// Returns false if the file can't be opened, and throws runtime_error if
+	// it's damaged
+	bool open(const char* path);
+
+	uint32_t count() const {
+		return m_count;
+	}
+
+	// Returns false if there's no such page or its block is damaged
+	bool text(uint32_t id, std::string& out);
+
+private:
+	mapped_file m_file;
+	uint32_t m_count, m_blocks;
+	uint64_t m_index;
+	uint32_t m_cached; // Block held in m_block
+	std::string m_block;
+};
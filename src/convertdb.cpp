@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdexcept>
+#include <vector>
+#include <string>
+
+#include "mapfile.hpp"
+#include "bytes.hpp"
+#include "format.hpp"
+
+using namespace std;
+
+void fail(int n, const char* msg, ...) {
+	va_list v;
+	va_start(v, msg);
+	vfprintf(stderr, msg, v);
+	va_end(v);
+	exit(n);
+}
+
+// Map a version 1 table, or return false if it has already been converted
+bool openV1(mapped_file& m, const char* path, uint32_t kind) {
+	if(!m.map(path))
+		fail(2, "Cannot open %s\n", path);
+	try {
+		if(v2Header(m, kind) != NULL) {
+			printf("%s is already converted\n", path);
+			return false;
+		}
+	} catch(runtime_error& e) {
+		fail(2, "%s: %s\n", path, e.what());
+	}
+	m.adviseRandom();
+	return true;
+}
+
+void openOutput(BinaryWriter& f, const string& path) {
+	if(!f.open(path.c_str()))
+		fail(2, "Cannot open %s\n", path.c_str());
+}
+
+// Finish a table written under a temporary name and move it over the old one
+void replaceWith(BinaryWriter& f, v2_writer& w, const string& tmp,
+		const char* path) {
+	w.close();
+	if(!f.close())
+		fail(2, "Error writing %s\n", tmp.c_str());
+	if(rename(tmp.c_str(), path) != 0)
+		fail(2, "Cannot replace %s\n", path);
+}
+
+void convertNames(const char* path) {
+	mapped_file m;
+	if(!openV1(m, path, V2_NAMES)) return;
+	if(m.size < 4)
+		fail(2, "%s is damaged\n", path);
+	uint32_t n = m.int32At(0);
+	size_t data = 4 + 4*(size_t)n;
+	if(data > m.size)
+		fail(2, "%s is damaged\n", path);
+
+	string tmp = string(path) + ".tmp";
+	BinaryWriter f;
+	openOutput(f, tmp);
+	v2_writer w(f, V2_NAMES, n);
+	vector<uint64_t> index(n+2, 0);
+	w.section(1);
+	for(uint32_t id=1;id<=n;id++) {
+		size_t p = data + m.int32At(4*(size_t)id);
+		if(p + 2 > m.size || p + 2 + m.int16At(p) > m.size)
+			fail(2, "%s is damaged at page %u\n", path, id);
+		uint16_t len = m.int16At(p);
+		w.write(m.data + p + 2, len);
+		index[id+1] = index[id] + len;
+	}
+	w.section(0);
+	w.write(&index[0], 8*index.size());
+	replaceWith(f, w, tmp, path);
+	printf("Converted %u names\n", n);
+}
+
+void convertLinks(const char* path, uint32_t kind) {
+	mapped_file m;
+	if(!openV1(m, path, kind)) return;
+	if(m.size < 4)
+		fail(2, "%s is damaged\n", path);
+	uint32_t n = m.int32At(0);
+	if(4 + 4*(uint64_t)n > m.size)
+		fail(2, "%s is damaged\n", path);
+
+	string tmp = string(path) + ".tmp";
+	BinaryWriter f;
+	openOutput(f, tmp);
+	v2_writer w(f, kind, n);
+	vector<uint64_t> index(n+2, 0);
+	vector<uint32_t> list;
+	w.section(1);
+	for(uint32_t id=1;id<=n;id++) {
+		size_t p = m.int32At(4*(size_t)id);
+		if(p + 4 > m.size || p + 4 + 4*(uint64_t)m.int32At(p) > m.size)
+			fail(2, "%s is damaged at page %u\n", path, id);
+		list.resize(m.int32At(p));
+		decodeInt32Array(m.data + p + 4, list.data(), list.size());
+		w.write(list.data(), 4*list.size());
+		index[id+1] = index[id] + list.size();
+	}
+	w.section(0);
+	w.write(&index[0], 8*index.size());
+	replaceWith(f, w, tmp, path);
+	printf("Converted %llu links for %u pages\n",
+			(unsigned long long)index[n+1], n);
+}
+
+void convertRedirects(const char* path) {
+	mapped_file m;
+	if(!openV1(m, path, V2_REDIRECTS)) return;
+	if(m.size % 8 != 0)
+		fail(2, "%s is damaged\n", path);
+
+	string tmp = string(path) + ".tmp";
+	BinaryWriter f;
+	openOutput(f, tmp);
+	v2_writer w(f, V2_REDIRECTS, m.size / 8);
+	vector<uint32_t> pairs(m.size / 4);
+	decodeInt32Array(m.data, pairs.data(), pairs.size());
+	w.section(0);
+	w.write(pairs.data(), 4*pairs.size());
+	replaceWith(f, w, tmp, path);
+	printf("Converted %zu redirects\n", pairs.size() / 2);
+}
+
+// Convert the tables of the database in the current directory to the
+// version 2 format. name_id.bin, name_mph.bin and any overlay are the same
+// in both versions and are left alone. Databases from before id_inlinks.bin
+// don't have one.
+int main(int argc, char** argv) {
+	if(argc != 1) {
+		fprintf(stderr, "Usage: %s\n", argv[0]);
+		return 1;
+	}
+	convertNames("id_name.bin");
+	convertLinks("id_links.bin", V2_LINKS);
+	if(access("id_inlinks.bin", F_OK) == 0)
+		convertLinks("id_inlinks.bin", V2_INLINKS);
+	convertRedirects("redirects.bin");
+	return 0;
+}
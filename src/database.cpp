@@ -0,0 +1,195 @@
+#include "database.hpp"
+#include "bytes.hpp"
+
+#include <string.h>
+#include <stdexcept>
+
+using namespace std;
+
+// Each node is a value flag, the value if present, an edge count and then the
+// edges, each a label and the offset of the node it leads to. Edges of a node
+// are sorted and have distinct first bytes, so at most one of them can match.
+uint32_t lookupName(const mapped_file& m, const string& key) {
+	size_t addr = 0, pos = 0;
+	while(true) {
+		if(addr + 3 > m.size) return 0;
+		bool hasValue = m.data[addr] != 0;
+		size_t p = addr + 1;
+		uint32_t value = 0;
+		if(hasValue) {
+			if(p + 6 > m.size) return 0;
+			value = m.int32At(p);
+			p += 4;
+		}
+		if(pos == key.length()) return hasValue ? value : 0;
+
+		uint16_t numEdges = m.int16At(p);
+		p += 2;
+		uint8_t next = key[pos];
+		size_t child = 0;
+		for(uint16_t i=0;i<numEdges;i++) {
+			if(p + 2 > m.size) return 0;
+			uint16_t labelLen = m.int16At(p);
+			const uint8_t* label = m.data + p + 2;
+			p += 2 + labelLen + 4;
+			if(p > m.size || labelLen == 0) return 0;
+			if(label[0] < next) continue;
+			if(label[0] > next) return 0;
+
+			if(labelLen > key.length() - pos ||
+					memcmp(label, key.data() + pos, labelLen) != 0)
+				return 0;
+			pos += labelLen;
+			child = m.int32At(p - 4);
+			break;
+		}
+		if(child == 0) return 0;
+		addr = child;
+	}
+}
+
+bool lookupRedirect(const mapped_file& m, uint32_t id, uint32_t& target) {
+	size_t lo = 0, hi = m.size / 8;
+	while(lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		uint32_t page = m.int32At(8*mid);
+		if(page == id) {
+			target = m.int32At(8*mid + 4);
+			return true;
+		}
+		if(page < id) lo = mid + 1;
+		else hi = mid;
+	}
+	return false;
+}
+
+bool name_table::open(const char* path) {
+	if(!m_file.map(path)) return false;
+	m_v2 = v2Header(m_file, V2_NAMES);
+	if(m_v2 != NULL) {
+		m_count = m_v2->count;
+		m_index = v2Section<uint64_t>(m_file, m_v2, 0);
+		m_chars = v2Section<char>(m_file, m_v2, 1);
+		if(m_index[m_count + 1] > m_v2->sections[1].size)
+			throw runtime_error("Damaged id_name.bin");
+		return true;
+	}
+	if(m_file.size < 4)
+		throw runtime_error("Damaged id_name.bin");
+	m_count = m_file.int32At(0);
+	if(4 + 4*(uint64_t)m_count > m_file.size)
+		throw runtime_error("Damaged id_name.bin");
+	return true;
+}
+
+bool name_table::name(uint32_t id, string& out) const {
+	if(id == 0 || id > m_count) return false;
+	if(m_v2 != NULL) {
+		// The last offset was checked against the file when it was opened
+		uint64_t begin = m_index[id], end = m_index[id+1];
+		if(begin > end || end > m_index[m_count + 1]) return false;
+		out.assign(m_chars + begin, end - begin);
+		return true;
+	}
+	size_t p = 4 + 4*(size_t)m_count + m_file.int32At(4*(size_t)id);
+	if(p + 2 > m_file.size) return false;
+	uint16_t len = m_file.int16At(p);
+	if(p + 2 + len > m_file.size) return false;
+	out.assign((const char*)m_file.data + p + 2, len);
+	return true;
+}
+
+bool redirect_table::open(const char* path) {
+	if(!m_file.map(path)) return false;
+	const v2_header* h = v2Header(m_file, V2_REDIRECTS);
+	if(h != NULL) {
+		m_pairs = v2Section<uint32_t>(m_file, h, 0);
+		m_count = h->count;
+	}
+	return true;
+}
+
+bool redirect_table::lookup(uint32_t id, uint32_t& target) const {
+	if(m_pairs == NULL) return lookupRedirect(m_file, id, target);
+	size_t lo = 0, hi = m_count;
+	while(lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		uint32_t page = m_pairs[2*mid];
+		if(page == id) {
+			target = m_pairs[2*mid + 1];
+			return true;
+		}
+		if(page < id) lo = mid + 1;
+		else hi = mid;
+	}
+	return false;
+}
+
+bool delta_overlay::load() {
+	bool names = m_names.map("delta_id_name.bin"),
+		ids = m_ids.map("delta_name_id.bin"),
+		links = m_links.map("delta_links.bin"),
+		redirects = m_redirects.map("delta_redirects.bin");
+	m_present = false;
+	if(!names && !ids && !links && !redirects) return false;
+	if(!names || !ids || !links || !redirects)
+		throw runtime_error("Incomplete overlay, delta_*.bin files are missing");
+
+	// Check that the tables fit in their files, so lookups can't run off
+	// the end of a mapping
+	if(m_names.size < 8 || m_links.size < 4 || m_redirects.size % 8 != 0)
+		throw runtime_error("Damaged overlay");
+	m_first = m_names.int32At(0);
+	m_count = m_names.int32At(4);
+	m_linkEntries = m_links.int32At(0);
+	if(8 + 4*(uint64_t)m_count > m_names.size ||
+			4 + 8*(uint64_t)m_linkEntries > m_links.size)
+		throw runtime_error("Damaged overlay");
+	m_present = true;
+	return true;
+}
+
+uint32_t delta_overlay::lookupName(const string& key) const {
+	if(!m_present) return 0;
+	return ::lookupName(m_ids, key);
+}
+
+bool delta_overlay::name(uint32_t id, string& out) const {
+	if(!m_present || id < m_first || id - m_first >= m_count) return false;
+	size_t data = 8 + 4*(size_t)m_count;
+	size_t p = data + m_names.int32At(8 + 4*(size_t)(id - m_first));
+	if(p + 2 > m_names.size) return false;
+	uint16_t len = m_names.int16At(p);
+	if(p + 2 + len > m_names.size) return false;
+	out.assign((const char*)m_names.data + p + 2, len);
+	return true;
+}
+
+bool delta_overlay::links(uint32_t id, vector<uint32_t>& out) const {
+	if(!m_present) return false;
+	size_t lo = 0, hi = m_linkEntries;
+	while(lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		uint32_t page = linkEntryID(mid);
+		if(page < id) {
+			lo = mid + 1;
+			continue;
+		} else if(page > id) {
+			hi = mid;
+			continue;
+		}
+
+		size_t p = m_links.int32At(8 + 8*mid);
+		if(p + 4 > m_links.size) return false;
+		uint32_t n = m_links.int32At(p);
+		if(p + 4 + 4*(uint64_t)n > m_links.size) return false;
+		out.resize(n);
+		decodeInt32Array(m_links.data + p + 4, out.data(), n);
+		return true;
+	}
+	return false;
+}
+
+bool delta_overlay::redirect(uint32_t id, uint32_t& target) const {
+	return m_present && lookupRedirect(m_redirects, id, target);
+}
@@ -0,0 +1,118 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "mapfile.hpp"
+#include "format.hpp"
+
+// Look up a normalized title in a mapped name_id.bin trie. Returns 0 if the
+// title isn't there.
+uint32_t lookupName(const mapped_file& m, const std::string& key);
+
+// Find a page in a mapped table of (page, target) pairs sorted by page, such
+// as redirects.bin. Returns false if the page has no entry.
+bool lookupRedirect(const mapped_file& m, uint32_t id, uint32_t& target);
+
+/* Page names from id_name.bin, read in place from either format */
+class name_table {
+public:
+	name_table() : m_v2(NULL), m_count(0) {
+	}
+
+	// Returns false if the file can't be opened, and fails if it's damaged
+	bool open(const char* path);
+
+	uint32_t count() const {
+		return m_count;
+	}
+
+	bool name(uint32_t id, std::string& out) const;
+
+private:
+	mapped_file m_file;
+	const v2_header* m_v2;
+	const uint64_t* m_index;
+	const char* m_chars;
+	uint32_t m_count;
+};
+
+/* The redirect table from redirects.bin, in either format */
+class redirect_table {
+public:
+	redirect_table() : m_pairs(NULL), m_count(0) {
+	}
+
+	// Returns false if the file can't be opened, and fails if it's damaged
+	bool open(const char* path);
+
+	bool lookup(uint32_t id, uint32_t& target) const;
+
+private:
+	mapped_file m_file;
+	const uint32_t* m_pairs; // Set for v2 files
+	size_t m_count;
+};
+
+/* The overlay written by preprocess --incremental on top of a full database.
+ * It names the pages added since the full build, and replaces the link lists
+ * and redirect targets of every page that changed. Readers consult it before
+ * the base files. */
+class delta_overlay {
+public:
+	delta_overlay() : m_present(false), m_first(0), m_count(0),
+			m_linkEntries(0) {
+	}
+
+	// Map the overlay files in the current directory. Returns false if there
+	// is no overlay, and fails if only part of one is there or it's damaged.
+	bool load();
+
+	bool present() const {
+		return m_present;
+	}
+
+	// Pages added by the overlay have IDs [firstID, firstID + count)
+	uint32_t firstID() const {
+		return m_first;
+	}
+
+	uint32_t count() const {
+		return m_count;
+	}
+
+	uint32_t lookupName(const std::string& key) const;
+	bool name(uint32_t id, std::string& out) const;
+
+	// Replace out with the page's links if the overlay has a list for it
+	bool links(uint32_t id, std::vector<uint32_t>& out) const;
+
+	// A target of 0 means the page is no longer a redirect
+	bool redirect(uint32_t id, uint32_t& target) const;
+
+	bool hasRedirects() const {
+		return m_redirects.size > 0;
+	}
+
+	// Raw access to the entries, for merging into a new overlay
+	uint32_t linkEntries() const {
+		return m_linkEntries;
+	}
+
+	uint32_t linkEntryID(uint32_t i) const {
+		return m_links.int32At(4 + 8*(size_t)i);
+	}
+
+	uint32_t redirectEntries() const {
+		return m_redirects.size / 8;
+	}
+
+	uint32_t redirectEntryID(uint32_t i) const {
+		return m_redirects.int32At(8*(size_t)i);
+	}
+
+private:
+	mapped_file m_names, m_ids, m_links, m_redirects;
+	bool m_present;
+	uint32_t m_first, m_count, m_linkEntries;
+};
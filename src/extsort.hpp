@@ -0,0 +1,171 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+/* Sorts a stream of fixed-size records using a bounded amount of memory.
+ * Records are collected in a buffer of at most `budget` bytes; each time it
+ * fills up it is sorted and written out as a run. Once everything has been
+ * pushed, next() returns all records in order by merging the runs, or
+ * straight from the buffer if nothing had to be spilled. R must be trivially
+ * copyable and define operator<. */
+template<typename R>
+class external_sorter {
+	typedef std::pair<R, size_t> head;
+
+	struct head_greater {
+		bool operator()(const head& a, const head& b) const {
+			return b.first < a.first;
+		}
+	};
+
+	struct run_reader {
+		FILE* f;
+		std::vector<R> buf;
+		size_t pos, len;
+
+		bool next(R& out) {
+			if(pos == len) {
+				len = fread(&buf[0], sizeof(R), buf.size(), f);
+				pos = 0;
+				if(len == 0) return false;
+			}
+			out = buf[pos++];
+			return true;
+		}
+	};
+
+public:
+	external_sorter(const std::string& prefix, size_t budget) :
+			m_prefix(prefix), m_pos(0), m_count(0) {
+		m_capacity = std::max<size_t>(budget / sizeof(R), 1024);
+		m_buffer.reserve(m_capacity);
+	}
+
+	~external_sorter() {
+		for(size_t i=0;i<m_readers.size();i++) fclose(m_readers[i].f);
+		for(size_t i=0;i<m_runs.size();i++) remove(m_runs[i].c_str());
+	}
+
+	void push(const R& r) {
+		m_buffer.push_back(r);
+		m_count++;
+		if(m_buffer.size() >= m_capacity) spill();
+	}
+
+	// Stop accepting records and get ready to return them in order. Each run
+	// is read through its own buffer, together using about readBudget bytes.
+	void finish(size_t readBudget) {
+		if(m_runs.empty()) {
+			std::sort(m_buffer.begin(), m_buffer.end());
+			return;
+		}
+		spill();
+		std::vector<R>().swap(m_buffer);
+
+		size_t per = std::max<size_t>(readBudget / sizeof(R) / m_runs.size(),
+				256);
+		m_readers.resize(m_runs.size());
+		for(size_t i=0;i<m_runs.size();i++) {
+			run_reader& r = m_readers[i];
+			r.f = fopen(m_runs[i].c_str(), "rb");
+			if(r.f == NULL)
+				throw std::runtime_error("Cannot reopen " + m_runs[i]);
+			r.buf.resize(per);
+			r.pos = r.len = 0;
+			R first;
+			if(r.next(first)) m_heap.push(head(first, i));
+		}
+	}
+
+	bool next(R& out) {
+		if(m_readers.empty()) {
+			if(m_pos == m_buffer.size()) return false;
+			out = m_buffer[m_pos++];
+			return true;
+		}
+		if(m_heap.empty()) return false;
+		head h = m_heap.top();
+		m_heap.pop();
+		out = h.first;
+		R following;
+		if(m_readers[h.second].next(following))
+			m_heap.push(head(following, h.second));
+		return true;
+	}
+
+	// Spill whatever is buffered, so the runs on disk hold every record
+	// pushed so far. Returns the number of runs.
+	size_t checkpoint() {
+		spill();
+		return m_runs.size();
+	}
+
+	// Take over the first `runs` runs left behind by an earlier process that
+	// used the same prefix, holding `count` records. Anything pushed since
+	// that process checkpointed is in later runs, which get overwritten.
+	void adopt(size_t runs, uint64_t count) {
+		m_runs.clear();
+		for(size_t i=0;i<runs;i++) {
+			std::string name = runName(i);
+			FILE* f = fopen(name.c_str(), "rb");
+			if(f == NULL) throw std::runtime_error("Missing run " + name);
+			fclose(f);
+			m_runs.push_back(name);
+		}
+		m_buffer.clear();
+		m_count = count;
+	}
+
+	uint64_t size() const {
+		return m_count;
+	}
+
+	// Bytes of records held in memory: those not yet spilled, or once
+	// finished, the read buffers or the whole sorted buffer
+	size_t bytes() const {
+		size_t n = m_buffer.size();
+		for(size_t i=0;i<m_readers.size();i++) n += m_readers[i].buf.size();
+		return n * sizeof(R);
+	}
+
+	size_t runs() const {
+		return m_runs.size();
+	}
+
+private:
+	void spill() {
+		if(m_buffer.empty()) return;
+		std::sort(m_buffer.begin(), m_buffer.end());
+		std::string name = runName(m_runs.size());
+		FILE* f = fopen(name.c_str(), "wb");
+		if(f == NULL) throw std::runtime_error("Cannot create " + name);
+		if(fwrite(&m_buffer[0], sizeof(R), m_buffer.size(), f) != m_buffer.size()) {
+			fclose(f);
+			throw std::runtime_error("Short write to " + name);
+		}
+		fclose(f);
+		m_runs.push_back(name);
+		m_buffer.clear();
+	}
+
+	std::string runName(size_t i) const {
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".%04zu.run", i);
+		return m_prefix + suffix;
+	}
+
+	std::string m_prefix;
+	size_t m_capacity;
+	std::vector<R> m_buffer;
+	size_t m_pos;
+	uint64_t m_count;
+	std::vector<std::string> m_runs;
+	std::vector<run_reader> m_readers;
+	std::priority_queue<head, std::vector<head>, head_greater> m_heap;
+};
@@ -0,0 +1,66 @@
+#include "format.hpp"
+
+#include <string.h>
+#include <stdexcept>
+
+using namespace std;
+
+const v2_header* v2Header(const mapped_file& m, uint32_t kind) {
+	if(m.size < sizeof(v2_header) || memcmp(m.data, V2_MAGIC, 8) != 0)
+		return NULL;
+	const v2_header* h = (const v2_header*)m.data;
+	if(h->version != V2_VERSION)
+		throw runtime_error("Unsupported table version");
+	if(h->byteOrder != V2_BYTE_ORDER)
+		throw runtime_error("Table was written with the other byte order");
+	if(h->kind != kind)
+		throw runtime_error("Table is of the wrong kind");
+	for(int i=0;i<V2_SECTIONS;i++) {
+		const v2_section& s = h->sections[i];
+		if(s.offset % 8 != 0 || s.offset > m.size || s.size > m.size - s.offset)
+			throw runtime_error("Damaged table");
+	}
+
+	// The index must cover every page, and redirects come in pairs
+	uint64_t need = (kind == V2_REDIRECTS) ? 8*h->count : 8*(h->count + 2);
+	if(h->sections[0].size < need)
+		throw runtime_error("Damaged table");
+	return h;
+}
+
+v2_writer::v2_writer(BinaryWriter& f, uint32_t kind, uint64_t count) :
+		m_file(f), m_section(-1) {
+	memset(&m_header, 0, sizeof(m_header));
+	memcpy(m_header.magic, V2_MAGIC, 8);
+	m_header.version = V2_VERSION;
+	m_header.byteOrder = V2_BYTE_ORDER;
+	m_header.kind = kind;
+	m_header.count = count;
+
+	// Leave room for the header, which is filled in once the sections are
+	// known
+	m_file.skip(sizeof(m_header));
+}
+
+void v2_writer::section(int i) {
+	endSection();
+	m_file.skip((8 - m_file.tell() % 8) % 8);
+	m_section = i;
+	m_header.sections[i].offset = m_file.tell();
+}
+
+void v2_writer::write(const void* data, size_t size) {
+	m_file.write(data, size);
+}
+
+void v2_writer::endSection() {
+	if(m_section < 0) return;
+	v2_section& s = m_header.sections[m_section];
+	s.size = m_file.tell() - s.offset;
+	m_section = -1;
+}
+
+void v2_writer::close() {
+	endSection();
+	m_file.patch(0, &m_header, sizeof(m_header));
+}
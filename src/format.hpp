@@ -0,0 +1,70 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#include "mapfile.hpp"
+#include "binarywriter.hpp"
+
+/* Version 2 of the table files: id_name.bin, id_links.bin and redirects.bin.
+ * A header names the kind of table and where its sections are, and every
+ * section starts on an 8-byte boundary and is in the byte order of the
+ * machine that wrote it, so a mapped file can be read as arrays in place.
+ * Version 1 files have no header and are told apart by the magic. */
+#define V2_MAGIC "WIKIMAP"
+#define V2_VERSION 2
+#define V2_BYTE_ORDER 0x01020304u
+#define V2_SECTIONS 2
+
+enum v2_kind {
+	V2_NAMES = 1, // Index of uint64 offsets into the characters, then the characters
+	V2_LINKS = 2, // Index of uint64 offsets into the targets, then uint32 targets
+	V2_REDIRECTS = 3, // (redirect, target) pairs of uint32s
+	V2_INLINKS = 4 // As V2_LINKS, listing the pages that link to each page
+};
+
+struct v2_section {
+	uint64_t offset, size; // In bytes from the start of the file
+};
+
+struct v2_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder; // V2_BYTE_ORDER as written by the producer
+	uint32_t kind;
+	uint32_t reserved;
+	uint64_t count; // Pages for names and links, entries for redirects
+	v2_section sections[V2_SECTIONS];
+};
+
+// Returns the header of a mapped v2 table of the given kind, or NULL if the
+// file is in the version 1 format. A v2 file that is of another kind, from a
+// machine of the other byte order or doesn't fit its sections throws
+// runtime_error.
+const v2_header* v2Header(const mapped_file& m, uint32_t kind);
+
+template<class T>
+inline const T* v2Section(const mapped_file& m, const v2_header* h, int i) {
+	return (const T*)(m.data + h->sections[i].offset);
+}
+
+// Writes a v2 table to a file that has nothing in it yet. Sections can be
+// written in any order, each one in one or more pieces, and the header is
+// filled in when the writer is closed.
+class v2_writer {
+public:
+	v2_writer(BinaryWriter& f, uint32_t kind, uint64_t count);
+
+	// Start section i at the next 8-byte boundary
+	void section(int i);
+	void write(const void* data, size_t size);
+
+	// Patch in the header. The file itself is left open.
+	void close();
+
+private:
+	void endSection();
+
+	BinaryWriter& m_file;
+	v2_header m_header;
+	int m_section;
+};
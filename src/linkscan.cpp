@@ -0,0 +1,76 @@
+#include "linkscan.hpp"
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Find the next "[[" at or after i, or return len if there is none
+static inline size_t findOpen(const char* s, size_t i, size_t len) {
+#ifdef __SSE2__
+	const __m128i br = _mm_set1_epi8('[');
+	for(;i + 17 <= len;i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(s+i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(s+i+1));
+		int m = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, br),
+					_mm_cmpeq_epi8(b, br)));
+		if(m != 0) return i + __builtin_ctz(m);
+	}
+#endif
+	for(;i + 1 < len;i++)
+		if(s[i] == '[' && s[i+1] == '[') return i;
+	return len;
+}
+
+// Find the next '|' or ']' at or after i, or return len if there is none
+static inline size_t findStop(const char* s, size_t i, size_t len) {
+#ifdef __SSE2__
+	const __m128i pipe = _mm_set1_epi8('|'), close = _mm_set1_epi8(']');
+	for(;i + 16 <= len;i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(s+i));
+		int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(a, pipe),
+					_mm_cmpeq_epi8(a, close)));
+		if(m != 0) return i + __builtin_ctz(m);
+	}
+#endif
+	for(;i < len;i++)
+		if(s[i] == '|' || s[i] == ']') return i;
+	return len;
+}
+
+void scanLinks(const char* text, size_t len, std::vector<link_span>& out) {
+	size_t p = 0;
+	while((p = findOpen(text, p, len)) < len) {
+		// The target runs up to the first '|' or ']'. If neither appears
+		// again, no later "[[" can match either.
+		size_t start = p + 2;
+		size_t stop = findStop(text, start, len);
+		if(stop == len) break;
+
+		size_t end = 0;
+		if(stop > start) {
+			if(text[stop] == ']') {
+				if(stop + 1 < len && text[stop+1] == ']') end = stop + 2;
+			} else {
+				// A label runs up to the first ']', which must be doubled
+				const char* c = (const char*)memchr(text + stop + 1, ']',
+						len - stop - 1);
+				if(c == NULL) break;
+				size_t close = c - text;
+				if(close > stop + 1 && close + 1 < len && text[close+1] == ']')
+					end = close + 2;
+			}
+		}
+
+		if(end == 0) {
+			// No match here, but one may start at the next character
+			p++;
+			continue;
+		}
+		link_span l;
+		l.offset = start;
+		l.length = stop - start;
+		out.push_back(l);
+		p = end;
+	}
+}
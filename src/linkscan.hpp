@@ -0,0 +1,15 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// Location of a link target within a page's wikitext
+struct link_span {
+	uint32_t offset, length;
+};
+
+// Scan wikitext for [[target]] and [[target|label]] links, appending the span
+// of each target to out. This finds exactly what the regular expression
+// \[\[([^|\]]+)(\|[^\]]+)?\]\] finds with regex_search, group 1 being the
+// target, but without copying the text or backtracking.
+void scanLinks(const char* text, size_t len, std::vector<link_span>& out);
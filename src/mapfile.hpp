@@ -0,0 +1,77 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* A read-only memory mapping of a whole file. The pages are shared with the
+ * page cache, so lookups read the file in place without copying it. */
+struct mapped_file {
+	const uint8_t* data;
+	size_t size;
+
+	mapped_file() : data(NULL), size(0) {
+	}
+
+	~mapped_file() {
+		unmap();
+	}
+
+	// populate reads the whole file in now rather than as it is touched
+	bool map(const char* path, bool populate = false) {
+		unmap();
+		int fd = open(path, O_RDONLY);
+		if(fd < 0) return false;
+		struct stat st;
+		if(fstat(fd, &st) != 0) {
+			close(fd);
+			return false;
+		}
+		if(st.st_size == 0) {
+			// Nothing to map, but the file is there
+			close(fd);
+			return true;
+		}
+		int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+		if(populate) flags |= MAP_POPULATE;
+#endif
+		void* p = mmap(NULL, st.st_size, PROT_READ, flags, fd, 0);
+		close(fd);
+		if(p == MAP_FAILED) return false;
+		data = (const uint8_t*)p;
+		size = st.st_size;
+		return true;
+	}
+
+	void unmap() {
+		if(data != NULL) munmap((void*)data, size);
+		data = NULL;
+		size = 0;
+	}
+
+	// Hint that accesses will jump around rather than stream through the file
+	void adviseRandom() {
+		if(data != NULL) madvise((void*)data, size, MADV_RANDOM);
+	}
+
+	// Hint that the file will be read from start to end
+	void adviseSequential() {
+		if(data != NULL) madvise((void*)data, size, MADV_SEQUENTIAL);
+	}
+
+	uint16_t int16At(size_t off) const {
+		return ((uint16_t)data[off] << 8) | data[off+1];
+	}
+
+	uint32_t int32At(size_t off) const {
+		return ((uint32_t)data[off] << 24) | ((uint32_t)data[off+1] << 16) |
+			((uint32_t)data[off+2] << 8) | data[off+3];
+	}
+
+private:
+	mapped_file(const mapped_file&);
+	mapped_file& operator=(const mapped_file&);
+};
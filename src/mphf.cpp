@@ -0,0 +1,263 @@
+#include "mphf.hpp"
+#include "bytes.hpp"
+
+#include <algorithm>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+static const double GAMMA = 2.0;
+static const uint32_t MAX_LEVELS = 32;
+static const size_t RANK_WORDS = 8; // One rank sample every 512 bits
+
+// Independent hash of a key for each level
+static inline uint64_t levelHash(uint64_t h, uint32_t level) {
+	h ^= 0x9e3779b97f4a7c15ULL * (level + 1);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// Map a hash onto [0, n) without a division
+static inline uint64_t reduce(uint64_t h, uint64_t n) {
+	return (uint64_t)(((unsigned __int128)h * n) >> 64);
+}
+
+static inline uint32_t fingerprint(uint64_t h) {
+	return (uint32_t)(h >> 32);
+}
+
+static bool operator<(const mph_key& a, const mph_key& b) {
+	return a.hash < b.hash;
+}
+
+struct mph_level_job {
+	const vector<mph_key>* keys;
+	size_t begin, end;
+	uint32_t level;
+	uint64_t bits;
+	uint64_t *seen, *collided;
+	vector<mph_key> placed, rest;
+};
+
+// Set each key's bit, and flag the bits that more than one key lands on
+static void markKeys(mph_level_job* job) {
+	const vector<mph_key>& keys = *job->keys;
+	for(size_t i=job->begin;i<job->end;i++) {
+		uint64_t p = reduce(levelHash(keys[i].hash, job->level), job->bits);
+		uint64_t mask = 1ULL << (p & 63);
+		if(__sync_fetch_and_or(&job->seen[p >> 6], mask) & mask)
+			__sync_fetch_and_or(&job->collided[p >> 6], mask);
+	}
+}
+
+// Keys on a bit of their own are placed on this level, the rest carry on
+static void splitKeys(mph_level_job* job) {
+	const vector<mph_key>& keys = *job->keys;
+	for(size_t i=job->begin;i<job->end;i++) {
+		uint64_t p = reduce(levelHash(keys[i].hash, job->level), job->bits);
+		if(job->collided[p >> 6] & (1ULL << (p & 63)))
+			job->rest.push_back(keys[i]);
+		else
+			job->placed.push_back(keys[i]);
+	}
+}
+
+struct mph_fill_job {
+	const vector<mph_key>* keys;
+	size_t begin, end;
+	uint32_t level;
+	uint64_t levelStart, bits;
+	const vector<uint64_t>* words;
+	const vector<uint32_t>* ranks;
+	vector<uint32_t>* slots;
+};
+
+static uint64_t rankOf(const vector<uint64_t>& words,
+		const vector<uint32_t>& ranks, uint64_t pos) {
+	size_t w = pos >> 6;
+	uint64_t r = ranks[w / RANK_WORDS];
+	for(size_t i=w - w % RANK_WORDS;i<w;i++) r += __builtin_popcountll(words[i]);
+	return r + __builtin_popcountll(words[w] & ((1ULL << (pos & 63)) - 1));
+}
+
+// Store each placed key's fingerprint and ID in its slot. Slots are distinct,
+// so threads never write to the same place.
+static void fillSlots(mph_fill_job* job) {
+	const vector<mph_key>& keys = *job->keys;
+	vector<uint32_t>& slots = *job->slots;
+	for(size_t i=job->begin;i<job->end;i++) {
+		uint64_t p = job->levelStart +
+			reduce(levelHash(keys[i].hash, job->level), job->bits);
+		uint64_t slot = rankOf(*job->words, *job->ranks, p);
+		slots[2*slot] = fingerprint(keys[i].hash);
+		slots[2*slot+1] = keys[i].id;
+	}
+}
+
+template<typename J>
+static void runJobs(vector<J>& jobs, void (*f)(J*)) {
+	vector<boost::thread*> running;
+	for(size_t i=1;i<jobs.size();i++)
+		running.push_back(new boost::thread(f, &jobs[i]));
+	f(&jobs[0]);
+	for(size_t i=0;i<running.size();i++) {
+		running[i]->join();
+		delete running[i];
+	}
+}
+
+template<typename J>
+static void splitRange(vector<J>& jobs, size_t n) {
+	for(size_t i=0;i<jobs.size();i++) {
+		jobs[i].begin = n * i / jobs.size();
+		jobs[i].end = n * (i+1) / jobs.size();
+	}
+}
+
+void writeMphf(vector<mph_key>& keys, int threads, BinaryWriter& out) {
+	if(threads < 1) threads = 1;
+	uint32_t nKeys = keys.size();
+	vector<uint64_t> words;
+	vector<uint64_t> levelStart(1, 0);
+	vector<vector<mph_key> > placed;
+
+	// Place keys level by level until (almost) none are left
+	vector<mph_key> current;
+	current.swap(keys);
+	while(!current.empty() && placed.size() < MAX_LEVELS) {
+		uint64_t nWords = (uint64_t)(current.size() * GAMMA + 63) / 64;
+		vector<uint64_t> seen(nWords, 0), collided(nWords, 0);
+
+		vector<mph_level_job> jobs(threads);
+		splitRange(jobs, current.size());
+		for(size_t i=0;i<jobs.size();i++) {
+			jobs[i].keys = &current;
+			jobs[i].level = placed.size();
+			jobs[i].bits = nWords * 64;
+			jobs[i].seen = &seen[0];
+			jobs[i].collided = &collided[0];
+		}
+		runJobs(jobs, markKeys);
+		runJobs(jobs, splitKeys);
+
+		for(size_t i=0;i<nWords;i++) words.push_back(seen[i] & ~collided[i]);
+		levelStart.push_back(words.size() * 64);
+
+		vector<mph_key> level, rest;
+		for(size_t i=0;i<jobs.size();i++) {
+			level.insert(level.end(), jobs[i].placed.begin(),
+					jobs[i].placed.end());
+			rest.insert(rest.end(), jobs[i].rest.begin(), jobs[i].rest.end());
+		}
+		placed.push_back(vector<mph_key>());
+		placed.back().swap(level);
+		current.swap(rest);
+	}
+	uint32_t nLevels = placed.size();
+
+	// Sample the rank at the start of every block of words
+	vector<uint32_t> ranks;
+	uint32_t count = 0;
+	for(size_t i=0;i<words.size();i++) {
+		if(i % RANK_WORDS == 0) ranks.push_back(count);
+		count += __builtin_popcountll(words[i]);
+	}
+	if(ranks.empty()) ranks.push_back(0);
+
+	vector<uint32_t> slots(2 * (size_t)count);
+	for(uint32_t l=0;l<nLevels;l++) {
+		vector<mph_fill_job> jobs(threads);
+		splitRange(jobs, placed[l].size());
+		for(size_t i=0;i<jobs.size();i++) {
+			jobs[i].keys = &placed[l];
+			jobs[i].level = l;
+			jobs[i].levelStart = levelStart[l];
+			jobs[i].bits = levelStart[l+1] - levelStart[l];
+			jobs[i].words = &words;
+			jobs[i].ranks = &ranks;
+			jobs[i].slots = &slots;
+		}
+		runJobs(jobs, fillSlots);
+		vector<mph_key>().swap(placed[l]);
+	}
+	sort(current.begin(), current.end());
+
+	// Header, then each level's size in words, the bits, the rank samples,
+	// the slots and finally the fallback table
+	out.writeInt32(nKeys);
+	out.writeInt32(nLevels);
+	out.writeInt32(current.size());
+	for(uint32_t l=0;l<nLevels;l++)
+		out.writeInt32((levelStart[l+1] - levelStart[l]) / 64);
+	for(size_t i=0;i<words.size();i++) out.writeInt64(words[i]);
+	out.writeInt32Array(ranks.data(), ranks.size());
+	out.writeInt32Array(slots.data(), slots.size());
+	for(size_t i=0;i<current.size();i++) {
+		out.writeInt64(current[i].hash);
+		out.writeInt32(current[i].id);
+	}
+	printf("Placed %u titles on %u levels, %u in the fallback table\n",
+			count, nLevels, (uint32_t)current.size());
+}
+
+static uint64_t int64At(const mapped_file& m, size_t off) {
+	return ((uint64_t)m.int32At(off) << 32) | m.int32At(off + 4);
+}
+
+bool mph_index::open(const mapped_file& file) {
+	m_file = &file;
+	if(file.size < 12) return false;
+	m_keys = file.int32At(0);
+	uint32_t nLevels = file.int32At(4);
+	m_fallback = file.int32At(8);
+	if(nLevels > MAX_LEVELS || file.size < 12 + 4 * (size_t)nLevels)
+		return false;
+
+	m_levelStart.assign(1, 0);
+	for(uint32_t l=0;l<nLevels;l++) {
+		uint64_t levelWords = file.int32At(12 + 4*l);
+		m_levelStart.push_back(m_levelStart.back() + levelWords * 64);
+	}
+	size_t nWords = m_levelStart.back() / 64;
+	size_t nRanks = max<size_t>((nWords + RANK_WORDS - 1) / RANK_WORDS, 1);
+	m_words = 12 + 4 * nLevels;
+	m_ranks = m_words + 8 * nWords;
+	m_slots = m_ranks + 4 * nRanks;
+	m_fallbackAt = m_slots + 8 * (size_t)(m_keys - m_fallback);
+	return m_fallback <= m_keys &&
+		m_fallbackAt + 12 * (size_t)m_fallback == file.size;
+}
+
+uint32_t mph_index::lookup(uint64_t hash) const {
+	const mapped_file& m = *m_file;
+	for(size_t l=0;l+1<m_levelStart.size();l++) {
+		uint64_t bits = m_levelStart[l+1] - m_levelStart[l];
+		uint64_t p = m_levelStart[l] + reduce(levelHash(hash, l), bits);
+		size_t w = p >> 6;
+		uint64_t word = int64At(m, m_words + 8*w);
+		if(!(word & (1ULL << (p & 63)))) continue;
+
+		// Found the level; count the set bits before this one
+		uint64_t slot = m.int32At(m_ranks + 4 * (w / RANK_WORDS));
+		for(size_t i=w - w % RANK_WORDS;i<w;i++)
+			slot += __builtin_popcountll(int64At(m, m_words + 8*i));
+		slot += __builtin_popcountll(word & ((1ULL << (p & 63)) - 1));
+		if(m.int32At(m_slots + 8*slot) != fingerprint(hash)) return 0;
+		return m.int32At(m_slots + 8*slot + 4);
+	}
+
+	// Not on any level, so it can only be in the fallback table
+	size_t lo = 0, hi = m_fallback;
+	while(lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		uint64_t h = int64At(m, m_fallbackAt + 12*mid);
+		if(h == hash) return m.int32At(m_fallbackAt + 12*mid + 8);
+		if(h < hash) lo = mid + 1;
+		else hi = mid;
+	}
+	return 0;
+}
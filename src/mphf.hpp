@@ -0,0 +1,43 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+#include "mapfile.hpp"
+#include "binarywriter.hpp"
+
+/* Minimal perfect hash index from title hashes to page IDs, built the way
+ * BBHash does it. Each level is a bit array about twice the size of the keys
+ * still unplaced; a key whose bit nobody else hit is placed there, the rest
+ * move on to the next level. A key's slot is the number of set bits before
+ * its own, and each slot holds a fingerprint and the page ID. Keys still
+ * unplaced after the last level go into a small sorted fallback table. */
+struct mph_key {
+	uint64_t hash;
+	uint32_t id;
+};
+
+// Build the index over keys and write it to out, marking bits on several
+// threads. Keys with equal hashes can't be told apart and end up in the
+// fallback table, where only one of them is found. The key vector is consumed.
+void writeMphf(std::vector<mph_key>& keys, int threads, BinaryWriter& out);
+
+// Query side of the index, reading straight from the mapped file
+class mph_index {
+public:
+	mph_index() : m_file(NULL) {
+	}
+
+	// Returns false if the file is not a valid index
+	bool open(const mapped_file& file);
+
+	// Returns the ID stored for a title hash, or 0 if the fingerprint shows
+	// the title is not in the index. A title that isn't there gets through
+	// with probability about 2^-32.
+	uint32_t lookup(uint64_t hash) const;
+
+private:
+	const mapped_file* m_file;
+	uint32_t m_keys, m_fallback;
+	std::vector<uint64_t> m_levelStart; // First bit of each level, then the end
+	size_t m_words, m_ranks, m_slots, m_fallbackAt;
+};
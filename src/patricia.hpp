@@ -1,232 +1,260 @@
 #pragma once
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
-#include <utility>
+#include <new>
 #include <string>
-#include <list>
+#include <vector>
+
+/* Bump allocator for trie nodes, edge arrays and labels. Memory is handed out
+ * from large blocks and only ever released all at once, which avoids the
+ * per-allocation overhead of the heap for millions of tiny objects. */
+class patricia_arena {
+	static const size_t BLOCK_SIZE = 1<<20;
+	std::vector<char*> m_blocks;
+	char* m_cur;
+	size_t m_left, m_total;
+
+public:
+	patricia_arena() : m_cur(NULL), m_left(0), m_total(0) {
+	}
+
+	~patricia_arena() {
+		clear();
+	}
 
-template<typename T, typename T2>
-struct patricia_list {
-	T first;
-	T2 second;
-	patricia_list<T,T2>* next;
-	
-	patricia_list(T fst, T2 snd) : next(NULL), first(fst), second(snd) {
+	void* alloc(size_t n) {
+		n = (n + 7) & ~(size_t)7;
+		if(n > m_left) {
+			size_t blk = (n > BLOCK_SIZE) ? n : BLOCK_SIZE;
+			m_cur = (char*)malloc(blk);
+			if(m_cur == NULL) throw std::bad_alloc();
+			m_blocks.push_back(m_cur);
+			m_left = blk;
+			m_total += blk;
+		}
+		void* p = m_cur;
+		m_cur += n;
+		m_left -= n;
+		return p;
 	}
 
-	~patricia_list() {
-		if(next != NULL) delete next;
+	const char* copy(const char* s, size_t n) {
+		char* p = (char*)alloc(n);
+		memcpy(p, s, n);
+		return p;
+	}
+
+	void clear() {
+		for(size_t i=0;i<m_blocks.size();i++) free(m_blocks[i]);
+		m_blocks.clear();
+		m_cur = NULL;
+		m_left = m_total = 0;
 	}
 
-	void append(T fst, T2 snd) {
-		if(next != NULL) next->append(fst, snd);
-		else next = new patricia_list<T,T2>(fst, snd);
+	size_t bytes() const {
+		return m_total;
 	}
+
+private:
+	patricia_arena(const patricia_arena&);
+	patricia_arena& operator=(const patricia_arena&);
 };
 
-template<typename T, typename S>
+/* A trie node. The label of the edge leading into a node is stored with the
+ * node itself, and the children are kept in an array sorted by the first byte
+ * of their labels, which is unique among siblings. Everything lives in the
+ * trie's arena, so T must not need destruction. */
+template<typename T>
 struct patricia_node {
-	typedef patricia_list<S, patricia_node<T,S>*>* edgelist;
-	T value;
+	const char* label;
+	uint32_t labelLen;
+	uint16_t nEdges, capEdges;
 	bool hasValue;
-	edgelist edges;
+	T value;
+	patricia_node<T>** edges;
 
-	patricia_node() : hasValue(false) {
-		edges = NULL;
+	uint8_t first() const {
+		return (uint8_t)label[0];
 	}
 
-	patricia_node(T v) : value(v), hasValue(true) {
-		edges = NULL;
+	void print(int indent=0) {
+		for(uint16_t i=0;i<nEdges;i++) {
+			printf("%*s'%.*s'\n", indent, "", (int)edges[i]->labelLen,
+					edges[i]->label);
+			edges[i]->print(indent+1);
+		}
 	}
+};
 
-	~patricia_node() {
-		if(edges != NULL) delete edges;
-	}
+template<typename T>
+struct patricia_trie {
+	typedef patricia_node<T> node_type;
+	node_type* root;
 
-	void print(int indent=0) {
-		char spaces[1024];
-		memset(spaces, ' ', 1024);
-		spaces[indent] = 0;
-		edgelist i;
-		for(i=edges;i != NULL;i = i->next) {
-			printf("%s'%s'\n", spaces, i->first.c_str());
-			i->second->print(indent+1);
-		}
+	patricia_trie() {
+		root = newNode(NULL, 0);
 	}
 
-	bool checkCycles() {
-		std::list<patricia_node<T,S>*> stack;
-		stack.push_back(this);
-		while(!stack.empty()) {
-			patricia_node<T,S>* elem = stack.back();
-			if(elem == NULL) continue;
-		}
-		for(edgelist i = edges;i != NULL;i = i->next) {
-			if(i->second == this) return true;
-		}
-		return false;
+	void clear() {
+		m_arena.clear();
+		root = newNode(NULL, 0);
 	}
 
-	void freePtrs() {
-		delete edges;
-		edgelist i;
-		for(i=edges;i != NULL;i=i->next)
-			i->second->freePtrs();
+	size_t bytes() const {
+		return m_arena.bytes();
 	}
 
-	void appendEdge(S s, patricia_node<T,S>* n) {
-		if(edges != NULL) {
-			edges->append(s,n);
-		} else {
-			edges = new patricia_list<S, patricia_node<T,S>*>(s,n);
+	T lookup(const char* key, size_t len, T def) const {
+		const node_type* node = root;
+		size_t pos = 0;
+		while(pos < len) {
+			const node_type* child = findChild(node, key[pos]);
+			if(child == NULL || child->labelLen > len - pos ||
+					memcmp(child->label, key + pos, child->labelLen) != 0)
+				return def;
+			pos += child->labelLen;
+			node = child;
 		}
+		return node->hasValue ? node->value : def;
 	}
-};
 
-void warnCycle() {
-	printf("BREAK - CYCLE DETECTED\n");
-}
+	T lookup(const std::string& key, T def) const {
+		return lookup(key.data(), key.length(), def);
+	}
 
-template<typename T, typename S=std::string>
-struct patricia_trie {
-	typedef patricia_node<T, S> node_type;
-	typedef patricia_list<S, node_type*>* edgelist;
-	node_type* root;
+	// Find the value stored for a key, storing def first if there is none
+	T& slot(const char* key, size_t len, T def) {
+		node_type* node = root;
+		size_t pos = 0;
+		while(pos < len) {
+			node_type* child = findChild(node, key[pos]);
+			if(child == NULL) {
+				// Nothing shares a prefix; hang the rest of the key here
+				child = newNode(m_arena.copy(key + pos, len - pos), len - pos);
+				addChild(node, child);
+				node = child;
+				break;
+			}
 
-	bool isPrefix(S pfx, S val) {
-		return countCommonPrefix(pfx,val) == pfx.length();
+			// Follow the edge as far as it matches the key
+			size_t common = 1;
+			size_t most = (child->labelLen < len - pos) ? child->labelLen :
+				len - pos;
+			while(common < most && child->label[common] == key[pos+common])
+				common++;
+			if(common < child->labelLen) {
+				// Split the edge; both halves keep pointing into the old label
+				node_type* middle = newNode(child->label, common);
+				replaceChild(node, middle);
+				child->label += common;
+				child->labelLen -= common;
+				addChild(middle, child);
+				child = middle;
+			}
+			node = child;
+			pos += common;
+		}
+		if(!node->hasValue) {
+			node->value = def;
+			node->hasValue = true;
+		}
+		return node->value;
 	}
 
-	int countCommonPrefix(S pfx, S val) {
-		typename S::iterator i,j;
-		int n = 0;
-		for(i=pfx.begin(),j=val.begin();i != pfx.end();i++,j++,n++)
-			if(*i != *j) return n;
-		return n;
+	T& slot(const std::string& key, T def) {
+		return slot(key.data(), key.length(), def);
 	}
 
-	patricia_trie() {
-		root = new node_type();
+	// Store a value for a key. If the key is already present it keeps the
+	// value it had.
+	void insert(const char* key, size_t len, T value) {
+		slot(key, len, value);
 	}
 
-	~patricia_trie() {
-		delete root;
+	void insert(const std::string& key, T value) {
+		slot(key.data(), key.length(), value);
 	}
 
-	void clear() {
-		delete root;
-		root = new node_type();
+	void print() {
+		root->print();
 	}
 
-	void freePtrs() {
-		// This assumes that T is a pointer type
-		root->freePtrs();
+	// Call f(key, value) for every key stored in the trie
+	template<class F>
+	void each(F& f) {
+		std::string key;
+		eachFrom(root, key, f);
 	}
 
-	T lookup(S key, T def) {
-		node_type* node = root;
-		while(node != NULL) {
-			if(key.empty()) {
-				if(node->hasValue) return node->value;
-				else return def;
-			}
-
-			// Select edge
-			edgelist i;
-			bool modified = false;
-			for(i=node->edges;i != NULL;i = i->next) {
-				if(isPrefix(i->first, key)) {
-					key.erase(0,i->first.length());
-					node = i->second;
-					modified = true;
-					break;
-				}
-			}
-			if(modified) continue;
-			return def;
+	template<class F>
+	void eachFrom(node_type* node, std::string& key, F& f) {
+		if(node->hasValue) f(key, node->value);
+		for(uint16_t i=0;i<node->nEdges;i++) {
+			size_t len = key.length();
+			key.append(node->edges[i]->label, node->edges[i]->labelLen);
+			eachFrom(node->edges[i], key, f);
+			key.resize(len);
 		}
-		return def;
 	}
 
-	void insert(S key, T value) {
-		node_type* node = root;
+private:
+	node_type* newNode(const char* label, size_t len) {
+		node_type* n = (node_type*)m_arena.alloc(sizeof(node_type));
+		n->label = label;
+		n->labelLen = len;
+		n->nEdges = n->capEdges = 0;
+		n->hasValue = false;
+		n->edges = NULL;
+		return n;
+	}
 
-		while(node != NULL) {
-			if(key.empty()) return;
-			if(node->edges == NULL) break;
-
-			// Select edge
-			edgelist i;
-			bool found_prefix = false;
-			for(i=node->edges;i != NULL;i = i->next) {
-				if(isPrefix(i->first, key)) {
-					// Remove the prefix from the key
-					key.erase(0,i->first.length());
-
-					// Traverse to the child and mark that we did
-					node = i->second;
-					found_prefix = true;
-					break;
-				}
-			}
-			if(!found_prefix) break;
+	// Binary search for the child whose label starts with c
+	static node_type* findChild(const node_type* node, char c) {
+		uint8_t b = (uint8_t)c;
+		int lo = 0, hi = (int)node->nEdges - 1;
+		while(lo <= hi) {
+			int mid = (lo + hi) / 2;
+			uint8_t f = node->edges[mid]->first();
+			if(f == b) return node->edges[mid];
+			if(f < b) lo = mid + 1;
+			else hi = mid - 1;
+		}
+		return NULL;
+	}
+
+	void addChild(node_type* node, node_type* child) {
+		if(node->nEdges == node->capEdges) {
+			// Outgrown arrays are simply abandoned in the arena
+			uint16_t cap = node->capEdges ? node->capEdges * 2 : 2;
+			node_type** edges = (node_type**)m_arena.alloc(
+					cap * sizeof(node_type*));
+			if(node->nEdges > 0)
+				memcpy(edges, node->edges, node->nEdges * sizeof(node_type*));
+			node->edges = edges;
+			node->capEdges = cap;
 		}
-		if(node == NULL) {
-			printf("\n\aFUCK IT!\n");
-			return;
+		uint16_t i = node->nEdges;
+		while(i > 0 && node->edges[i-1]->first() > child->first()) {
+			node->edges[i] = node->edges[i-1];
+			i--;
 		}
+		node->edges[i] = child;
+		node->nEdges++;
+	}
 
-		// We hit a dead end. Search for common prefixes in the outgoing edges
-		edgelist i;
-		node_type* newNode = new node_type(value);
-		int common;
-		for(i=node->edges;i != NULL;i = i->next) {
-			// Check if this outgoing edge shares a common prefix with the key
-			common = countCommonPrefix(i->first, key);
-
-			if(common > 0) {
-				// It does. Get the suffix of the existing edge, the prefix, and
-				// the suffix of the key.
-				S existing_suffix = i->first.substr(common);
-				S key_suffix = key.substr(common);
-				S prefix = i->first.substr(0,common);
-
-				// If the key is a substring of the existing edge, then just
-				// split the edge and make the current target a child of the new
-				// node. Otherwise, create a new node with no value to go
-				// between the prefix and suffixes
-				if(key_suffix.empty()) {
-					// Create a new outgoing edge
-					newNode->appendEdge(existing_suffix, i->second);
-
-					// Adjust the existing edge
-					i->first = prefix;
-					i->second = newNode;
-				} else {
-					// Create an intermediate node
-					node_type* middle_node = new node_type();
-					node_type* existing_node = i->second;
-
-					// Add it after the prefix
-					i->first = prefix;
-					i->second = middle_node;
-
-					// Add the two targets as its children
-					middle_node->appendEdge(existing_suffix, existing_node);
-					middle_node->appendEdge(key_suffix, newNode);
-				}
+	// Swap in a child that starts with the same byte as an existing one
+	void replaceChild(node_type* node, node_type* child) {
+		for(uint16_t i=0;i<node->nEdges;i++) {
+			if(node->edges[i]->first() == child->first()) {
+				node->edges[i] = child;
 				return;
 			}
 		}
-
-		// No edges share a prefix. Add the rest of the string as a new edge
-		node->appendEdge(key, newNode);
-	}
-	
-	void print() {
-		root->print();
 	}
+
+	patricia_arena m_arena;
 };
 
-typedef patricia_trie<uint32_t> ui32patricia; 
-typedef patricia_trie<uint32_t, std::wstring> wui32patricia; 
+typedef patricia_trie<uint32_t> ui32patricia;
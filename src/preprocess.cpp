@@ -2,6 +2,8 @@
 #include <ctype.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <getopt.h>
+#include <unistd.h>
 #include <fstream>
 #include <stdexcept>
 #include <map>
@@ -17,51 +19,260 @@
 #include <boost/iostreams/device/file.hpp>
 #include <boost/iostreams/operations.hpp>
 #include <boost/iostreams/stream.hpp>
-#include <boost/regex.hpp>
+#include <boost/thread.hpp>
 
 #include "rbt.hpp"
 #include "bytes.hpp"
 #include "strtree.hpp"
 #include "patricia.hpp"
+#include "bz2stream.hpp"
+#include "queue.hpp"
+#include "linkscan.hpp"
+#include "title.hpp"
+#include "extsort.hpp"
+#include "mphf.hpp"
+#include "database.hpp"
+#include "format.hpp"
+#include "binarywriter.hpp"
+#include "contentstore.hpp"
 
 using namespace std;
 namespace io = boost::iostreams;
 
-// An active parsing frame
+// An active parsing frame. Frames are handed from the XML parser to the link
+// extraction workers and then to the writer, which hands them back to the
+// parser through a frame_pool.
 struct parse_frame {
+	uint64_t seq; // Position of the page in the dump
 	bool redirect; // If true, content is the redirect target
-	xmlChar *title, *content;
+	bool hasTitle, hasContent; // Whether the page had a title and content
+	string title, content;
+	vector<link_span> links; // Link targets in content, filled in by a worker
 
-	parse_frame() : redirect(false), title(NULL), content(NULL) {
+	parse_frame() {
+		reset();
+	}
+
+	// Empty the frame for another page. The strings keep their memory, so a
+	// reused frame seldom needs to allocate.
+	void reset() {
+		seq = 0;
+		redirect = hasTitle = hasContent = false;
+		title.clear();
+		content.clear();
+		links.clear();
 	}
 };
 
-// Link structure during streaming processing
-struct streaming_link {
-	uint32_t target;
+// Frames that the writer is done with, kept for the parser to fill again
+class frame_pool {
+public:
+	~frame_pool() {
+		for(size_t i=0;i<m_frames.size();i++) delete m_frames[i];
+	}
+
+	parse_frame* get() {
+		boost::lock_guard<boost::mutex> lock(m_lock);
+		if(m_frames.empty()) return new parse_frame();
+		parse_frame* frame = m_frames.back();
+		m_frames.pop_back();
+		frame->reset();
+		return frame;
+	}
+
+	void put(parse_frame* frame) {
+		boost::lock_guard<boost::mutex> lock(m_lock);
+		m_frames.push_back(frame);
+	}
+
+private:
+	boost::mutex m_lock;
+	vector<parse_frame*> m_frames;
+};
+
+// The pages linking to one title, collected while streaming. The sources are
+// kept in chunks from an arena, each twice the size of the one before up to
+// a limit, and chained from the newest, so a title costs a pointer in the
+// trie and a 16 byte header per chunk rather than a heap vector. Sources are
+// page IDs, which stay well below 2^31, so the top bit marks a redirect.
+struct relocation_chunk {
+	relocation_chunk* prev;
+	uint32_t size, capacity;
+	uint32_t links[1]; // capacity entries
+};
+static const uint32_t RELOCATION_REDIRECT = 0x80000000u;
+static const uint32_t RELOCATION_CHUNK_MAX = 1024;
+
+// Fixed-size record for disk-backed link resolution. The key is either a
+// title hash or a packed (source, target) pair, and the value a page ID.
+struct spill_record {
+	uint64_t key;
+	uint32_t value, pad;
+
+	bool operator<(const spill_record& r) const {
+		return key < r.key || (key == r.key && value < r.value);
+	}
+};
+typedef external_sorter<spill_record> spill_sorter;
+
+// Checkpoints are taken by the writer every so many pages, but only where the
+// input can be picked up again: at a bzip2 stream boundary between pages.
+struct checkpoint_state {
+	bz2_parallel_source* source;
+	uint64_t interval; // Pages between checkpoints
+	uint64_t pagesBase; // Pages processed before this run started
+	uint64_t last; // Pages processed at the last checkpoint
+	uint64_t inputSize;
+};
+
+static const char CHECKPOINT_FILE[] = "preprocess.ckpt";
+static const uint32_t CHECKPOINT_MAGIC = 0x574d434b; // "WMCK"
+static const uint32_t CHECKPOINT_VERSION = 1;
+
+struct checkpoint_header {
+	uint64_t inputSize, offset, pages, memoryBudget, namesSize;
+	uint32_t currentID;
+	uint32_t titleRuns, linkRuns;
+	uint64_t titleCount, linkCount;
+};
+
+// A page from a delta dump, kept until the whole delta has been read so that
+// links to pages added later in it can still be resolved
+struct delta_page {
 	bool redirect;
+	uint32_t redirectTo; // Filled in once the delta has been read
+	vector<string> targets; // Normalized; the redirect target for a redirect
+};
+
+// State for --incremental. Pages in a delta dump keep the ID of the existing
+// page with the same title or are numbered after the last one, and the result
+// is merged with any earlier overlay.
+struct delta_target {
+	mapped_file baseIds;
+	redirect_table baseRedirects;
+	delta_overlay previous;
+	uint32_t baseCount, nextID;
+	ui32patricia newTitles; // Every page added since the full build
+	vector<string> newNames; // Their names, starting at ID baseCount+1
+	map<uint32_t, delta_page> pages;
 };
 
 struct result_target {
-	FILE *f_ids, *f_names, *f_links;
+	BinaryWriter f_ids, f_names, f_links, f_redirects;
 	ui32patricia idTree;
-	patricia_trie<vector<streaming_link>*> relocate;
-	map<uint32_t, list<uint32_t> > links;
-	map<uint32_t, size_t> offsetMap; // File offsets of name info
+	patricia_trie<relocation_chunk*> relocate;
+	patricia_arena relocationArena; // The relocation trie's chunks
+	vector<uint32_t> nameOffsets; // Name entry offsets, indexed by page ID
+	uint64_t namesSize;
+	vector<bool> isRedirect; // Indexed by page ID
 	uint32_t currentID;
+	int format; // Version of id_name.bin, id_links.bin and redirects.bin
+
+	// With a memory budget, links are resolved by sorting (hash, ID) runs on
+	// disk instead of through the relocation trie. Half of the budget goes to
+	// the sorts. The other half is for the title trie and the per-page
+	// tables, which can't be spilled, so the run stops if they outgrow it.
+	size_t memoryBudget;
+	size_t laterBytesPerPage; // Tables built once the dump has been read
+	spill_sorter *titleRuns, *linkRuns;
+
+	delta_target* delta; // Set when only building an overlay
+	checkpoint_state* ckpt; // Set when taking checkpoints
+	ContentWriter* content; // Set when storing the article text
 };
 
 void tolower(char* s) {
 	for(;*s != '\0';s++) *s = tolower(*s);
 }
 
+void fail(int n, const char* msg, ...) {
+	va_list v;
+	va_start(v, msg);
+	vfprintf(stderr, msg, v);
+	va_end(v);
+	exit(n);
+}
+
+// Find the link targets in a page. This is the expensive part of processing
+// a page, and runs on the worker threads.
+void extractLinks(parse_frame& frame) {
+	if(!frame.hasContent || !frame.hasTitle || frame.redirect) return;
+	scanLinks(frame.content.data(), frame.content.length(), frame.links);
+}
+
+// Append a source to a title's chunks, starting a new chunk if the newest is
+// full
+void addRelocation(result_target& out, relocation_chunk*& newest,
+		uint32_t link) {
+	if(newest == NULL || newest->size == newest->capacity) {
+		uint32_t cap = newest == NULL ? 2 :
+			min(2*newest->capacity, RELOCATION_CHUNK_MAX);
+		relocation_chunk* c = (relocation_chunk*)out.relocationArena.alloc(
+				sizeof(relocation_chunk) + 4*(cap-1));
+		c->prev = newest;
+		c->size = 0;
+		c->capacity = cap;
+		newest = c;
+	}
+	newest->links[newest->size++] = link;
+}
+
+// Number of sources in a title's chunks
+size_t relocationCount(const relocation_chunk* c) {
+	size_t n = 0;
+	for(;c != NULL;c = c->prev) n += c->size;
+	return n;
+}
+
+// Record a link from page source to the (normalized) title key
+void addLink(result_target& out, const string& key, uint32_t source,
+		bool redirect) {
+	if(key.empty()) return;
+	if(out.linkRuns != NULL) {
+		spill_record r = {titleHash(key.data(), key.length()), source,
+			redirect ? 1u : 0u};
+		out.linkRuns->push(r);
+		return;
+	}
+	addRelocation(out, out.relocate.slot(key, NULL),
+			source | (redirect ? RELOCATION_REDIRECT : 0));
+}
+
+// Bytes held by the title trie and the per-page tables, counting those that
+// are only built after parsing, which is known once the pages are
+size_t tableBytes(const result_target& out) {
+	return out.idTree.bytes() + 4*out.nameOffsets.capacity() +
+		out.isRedirect.capacity()/8 +
+		out.laterBytesPerPage*(size_t)out.currentID;
+}
+
+// Stop as soon as the tables can't fit in their half of the memory budget,
+// rather than at the end of a long run
+void checkTableBudget(const result_target& out) {
+	size_t bytes = tableBytes(out);
+	if(bytes > out.memoryBudget/2)
+		fail(4, "\nThe title trie and page tables for %u pages need %zu MB, "
+				"more than half of the memory budget; raise --memory-budget\n",
+				out.currentID, bytes >> 20);
+}
+
+// Add a page to the output. Frames must arrive here in dump order, so that
+// IDs come out the same no matter how many workers there are.
 void processFrame(parse_frame& frame, result_target& out) {
-	using namespace boost;
 	uint32_t ident = ++out.currentID;
-	if(frame.content == NULL || frame.title == NULL) {
-		if(frame.title != NULL && frame.content == NULL)
-			printf("\nWarning: page '%s' has null content\n", frame.title);
-		else if(frame.title == NULL && frame.content != NULL)
+	out.isRedirect.push_back(frame.redirect && frame.hasTitle);
+	if(out.content != NULL) {
+		bool article = frame.hasContent && !frame.redirect;
+		out.content->add(frame.content.data(),
+				article ? frame.content.length() : 0);
+	}
+	out.nameOffsets.push_back(out.namesSize);
+	if(!frame.hasTitle) {
+		out.f_names.writeInt16(0);
+		out.namesSize += 2;
+
+		// Pages with empty text are still named, they just have no links
+		if(frame.hasContent)
 			printf("\nWarning: page has null title\n");
 		else
 			printf("\nWarning: page has null frame and content\n");
@@ -69,141 +280,867 @@ void processFrame(parse_frame& frame, result_target& out) {
 		return;
 	}
 	if(out.currentID % 64 == 0)
-		printf("\rProcessing pages [%8d]: %120s", out.currentID, frame.title);
-	string tstr((const char*)frame.title);
+		printf("\rProcessing pages [%8d]: %120s", out.currentID,
+				frame.title.c_str());
 
 	// Write the name
-	out.offsetMap[ident] = ftell(out.f_names);
-	fwrite(frame.title, 1, xmlStrlen(frame.title), out.f_names);
-	char null = 0;
-	fwrite(&null, 1, 1, out.f_names);
+	uint16_t nameLen = min<size_t>(frame.title.length(), 0xffff);
+	out.f_names.writeInt16(nameLen);
+	out.f_names.write(frame.title.data(), nameLen);
+	out.namesSize += 2 + nameLen;
 
 	// Save the title in the ID buffer
-	out.idTree.insert((const char*)(frame.title), ident);
-
-	// Store links
-	string cstr((const char*)frame.content);
-	static const regex linkRE("\\[\\[([^|\\]]+)(\\|[^\\]]+)?\\]\\]",
-			regex::perl);
-	sregex_iterator iter(cstr.begin(), cstr.end(), linkRE);
-	sregex_iterator endIter;
-	for(;iter != endIter;iter++) {
-		sregex_iterator::value_type m = *iter;
-		// Get the target
-		const string link = m.str(1);
-
-		vector<streaming_link>* linkList = out.relocate.lookup(link, NULL);
-		if(linkList == NULL) {
-			linkList = new vector<streaming_link>();
-			out.relocate.insert(link, linkList);
-		}
-		streaming_link l;
-		l.target = ident;
-		l.redirect = frame.redirect;
-		linkList->push_back(l);
-	}
-}
-
-void storePatricia(ui32patricia::node_type* node,
-		map<ui32patricia::node_type*, size_t>& relocation, FILE* out) {
-	// Update relocation information
-	size_t begin = ftell(out);
-	map<ui32patricia::node_type*, size_t>::iterator itr = relocation.find(node);
-	if(itr != relocation.end()) {
-		fseek(out, itr->second, SEEK_SET);
-		writeInt32(begin, out);
-		fseek(out, begin, SEEK_SET);
-		relocation.erase(itr);
-	}
-	printf("\rWriting relocation data (%10d)", relocation.size());
+	string key;
+	normalizeTitle(frame.title.data(), frame.title.length(), key);
+	out.idTree.insert(key, ident);
+	if(out.titleRuns != NULL && !key.empty()) {
+		spill_record r = {titleHash(key.data(), key.length()), ident, 0};
+		out.titleRuns->push(r);
+	}
+	if(out.memoryBudget > 0 && ident % 4096 == 0) checkTableBudget(out);
 
-	// Write the value, if present
-	char hasValue = node->hasValue ? 1 : 0;
-	fwrite(&hasValue, 1, 1, out);
-	if(node->hasValue) writeInt32(node->value, out);
+	// Store links. A redirect has no links of its own; its target is kept
+	// as a link marked as a redirect instead.
+	if(frame.redirect && frame.hasContent) {
+		normalizeTitle(frame.content.data(), frame.content.length(), key);
+		addLink(out, key, ident, true);
+	}
+	for(vector<link_span>::iterator i=frame.links.begin();i != frame.links.end();i++) {
+		normalizeTitle(frame.content.data() + i->offset, i->length, key);
+		addLink(out, key, ident, false);
+	}
+}
 
-	// Count the edge list length and store it
-	uint16_t numEdges = 0;
-	for(ui32patricia::edgelist e=node->edges;e != NULL;e=e->next) numEdges++;
+// Record a page from a delta dump. A page that shows up more than once keeps
+// its last revision.
+void processDeltaFrame(parse_frame& frame, delta_target& d) {
+	if(!frame.hasTitle) return;
+	string key;
+	normalizeTitle(frame.title.data(), frame.title.length(), key);
+	if(key.empty()) return;
 
-	writeInt16(numEdges, out);
+	uint32_t id = d.newTitles.lookup(key, 0);
+	if(id == 0) id = lookupName(d.baseIds, key);
+	if(id == 0) {
+		id = d.nextID++;
+		d.newTitles.insert(key, id);
+		d.newNames.push_back(frame.title);
+	}
+	if(d.pages.size() % 64 == 0)
+		printf("\rProcessing pages [%8zu]: %120s", d.pages.size(),
+				frame.title.c_str());
+
+	delta_page& page = d.pages[id];
+	page.redirect = frame.redirect;
+	page.redirectTo = 0;
+	page.targets.clear();
+	if(frame.redirect && frame.hasContent) {
+		normalizeTitle(frame.content.data(), frame.content.length(), key);
+		page.targets.push_back(key);
+	}
+	for(vector<link_span>::iterator i=frame.links.begin();i != frame.links.end();i++) {
+		normalizeTitle(frame.content.data() + i->offset, i->length, key);
+		page.targets.push_back(key);
+	}
+}
 
-	// Write placeholders for each subnode
-	size_t phBase = ftell(out);
-	for(ui32patricia::edgelist e=node->edges;e != NULL;e=e->next) {
-		// Write the name
-		writeInt16(e->first.length(), out);
-		fwrite(e->first.c_str(), 1, e->first.length(), out);
+// Trie entries are stored front-coded: each key as the length it shares with
+// the previous key and the rest of it. each() visits the keys in order, so the
+// shared parts are long. A shared length of ~0 ends the list.
+struct key_writer {
+	FILE* f;
+	string prev;
 
-		// And the offset
-		relocation.insert(make_pair(e->second, ftell(out)));
-		writeInt32(0, out);
+	key_writer(FILE* file) : f(file) {
+	}
+
+	void key(const string& key) {
+		size_t shared = 0, most = min(prev.length(), key.length());
+		while(shared < most && prev[shared] == key[shared]) shared++;
+		writeInt32(shared, f);
+		writeInt32(key.length() - shared, f);
+		fwrite(key.data() + shared, 1, key.length() - shared, f);
+		prev = key;
+	}
+};
+
+struct id_writer : key_writer {
+	id_writer(FILE* file) : key_writer(file) {
+	}
+
+	void operator()(const string& k, uint32_t id) {
+		key(k);
+		writeInt32(id, f);
+	}
+};
+
+// Sources are written as they are kept, with the redirect flag in the top
+// bit, oldest first
+struct relocation_writer : key_writer {
+	vector<const relocation_chunk*> chunks;
+
+	relocation_writer(FILE* file) : key_writer(file) {
+	}
+
+	void operator()(const string& k, relocation_chunk* newest) {
+		key(k);
+		writeInt32(relocationCount(newest), f);
+		chunks.clear();
+		for(const relocation_chunk* c=newest;c != NULL;c = c->prev)
+			chunks.push_back(c);
+		for(size_t i=chunks.size();i-- > 0;)
+			writeInt32Array(chunks[i]->links, chunks[i]->size, f);
+	}
+};
+
+bool readKey(FILE* f, string& key) {
+	uint32_t shared = readInt32(f);
+	if(shared == 0xffffffffu || feof(f) || shared > key.length()) return false;
+	uint32_t rest = readInt32(f);
+	key.resize(shared + rest);
+	return rest == 0 || fread(&key[shared], 1, rest, f) == rest;
+}
+
+// Save everything the writer has built so far. The checkpoint is written
+// under a temporary name and renamed into place, so a crash while writing it
+// leaves the previous one intact.
+void writeCheckpoint(result_target& out, uint64_t pages, uint64_t offset) {
+	checkpoint_state& c = *out.ckpt;
+	string tmp = string(CHECKPOINT_FILE) + ".tmp";
+	FILE* f = fopen(tmp.c_str(), "wb");
+	if(f == NULL) {
+		printf("\nWarning: cannot write %s\n", tmp.c_str());
+		return;
+	}
+	setvbuf(f, NULL, _IOFBF, 1<<20);
+	if(!out.f_names.flush())
+		fail(2, "Error writing id_name.bin.data\n");
+	uint32_t titleRuns = 0, linkRuns = 0;
+	uint64_t titleCount = 0, linkCount = 0;
+	if(out.titleRuns != NULL) {
+		titleRuns = out.titleRuns->checkpoint();
+		titleCount = out.titleRuns->size();
+		linkRuns = out.linkRuns->checkpoint();
+		linkCount = out.linkRuns->size();
+	}
+
+	writeInt32(CHECKPOINT_MAGIC, f);
+	writeInt32(CHECKPOINT_VERSION, f);
+	writeInt64(c.inputSize, f);
+	writeInt64(offset, f);
+	writeInt64(c.pagesBase + pages, f);
+	writeInt64(out.memoryBudget, f);
+	writeInt64(out.namesSize, f);
+	writeInt32(out.currentID, f);
+	writeInt32(titleRuns, f);
+	writeInt32(linkRuns, f);
+	writeInt64(titleCount, f);
+	writeInt64(linkCount, f);
+
+	// Per-page tables; both have an entry for every ID including 0
+	for(uint32_t id=0;id <= out.currentID;id += 8) {
+		uint8_t bits = 0;
+		for(uint32_t i=0;i<8 && id+i <= out.currentID;i++)
+			if(out.isRedirect[id+i]) bits |= 1 << i;
+		fwrite(&bits, 1, 1, f);
+	}
+	writeInt32Array(&out.nameOffsets[0], out.currentID + 1, f);
+
+	id_writer ids(f);
+	out.idTree.each(ids);
+	writeInt32(0xffffffffu, f);
+	relocation_writer relocations(f);
+	out.relocate.each(relocations);
+	writeInt32(0xffffffffu, f);
+
+	if(ferror(f) || fclose(f) != 0 || rename(tmp.c_str(), CHECKPOINT_FILE) != 0) {
+		printf("\nWarning: failed to write checkpoint\n");
+		return;
+	}
+	c.last = pages;
+	printf("\nCheckpoint after %llu pages\n",
+			(unsigned long long)(c.pagesBase + pages));
+}
+
+bool readCheckpointHeader(FILE* f, checkpoint_header& h) {
+	if(readInt32(f) != CHECKPOINT_MAGIC || readInt32(f) != CHECKPOINT_VERSION)
+		return false;
+	h.inputSize = readInt64(f);
+	h.offset = readInt64(f);
+	h.pages = readInt64(f);
+	h.memoryBudget = readInt64(f);
+	h.namesSize = readInt64(f);
+	h.currentID = readInt32(f);
+	h.titleRuns = readInt32(f);
+	h.linkRuns = readInt32(f);
+	h.titleCount = readInt64(f);
+	h.linkCount = readInt64(f);
+	return !feof(f) && !ferror(f);
+}
+
+// Restore the writer's state from the rest of a checkpoint
+void readCheckpointState(FILE* f, const checkpoint_header& h,
+		result_target& out) {
+	out.currentID = h.currentID;
+	out.namesSize = h.namesSize;
+	out.isRedirect.assign(h.currentID + 1, false);
+	for(uint32_t id=0;id <= h.currentID;id += 8) {
+		uint8_t bits = 0;
+		fread(&bits, 1, 1, f);
+		for(uint32_t i=0;i<8 && id+i <= h.currentID;i++)
+			out.isRedirect[id+i] = (bits >> i) & 1;
+	}
+	out.nameOffsets.resize(h.currentID + 1);
+	readInt32Array(f, &out.nameOffsets[0], h.currentID + 1);
+
+	string key;
+	while(readKey(f, key)) out.idTree.insert(key, readInt32(f));
+	key.clear();
+	while(readKey(f, key)) {
+		relocation_chunk*& links = out.relocate.slot(key, NULL);
+		uint32_t n = readInt32(f);
+		for(uint32_t i=0;i<n;i++) addRelocation(out, links, readInt32(f));
+	}
+	if(ferror(f) || feof(f))
+		fail(1, "Checkpoint is truncated\n");
+}
+
+// Called by the writer after each page. Once enough pages have gone by,
+// checkpoint at the next point where the input can be resumed.
+void maybeCheckpoint(result_target& out, uint64_t pages) {
+	checkpoint_state& c = *out.ckpt;
+	if(pages - c.last < c.interval) return;
+	uint64_t offset;
+	if(c.source->boundary(pages, offset)) writeCheckpoint(out, pages, offset);
+}
+
+// Pipeline stages. The XML parser runs on the main thread and feeds complete
+// frames to a pool of link extractors, whose results are put back in order
+// for a single writer that owns the result_target.
+void extractorThread(BoundedQueue<parse_frame*>* in,
+		OrderedQueue<parse_frame*>* out) {
+	parse_frame* frame;
+	while(in->get(frame)) {
+		extractLinks(*frame);
+		out->put(frame->seq, frame);
+	}
+}
+
+void writerThread(OrderedQueue<parse_frame*>* in, result_target* out,
+		frame_pool* pool) {
+	parse_frame* frame;
+	while(in->get(frame)) {
+		if(out->delta != NULL) processDeltaFrame(*frame, *out->delta);
+		else processFrame(*frame, *out);
+		if(out->ckpt != NULL) maybeCheckpoint(*out, frame->seq + 1);
+		pool->put(frame);
+	}
+}
+
+// Assemble id_name.bin from the offset table and the name entries, which were
+// written to a temporary file as pages came in
+void writeNames(result_target& out, const char* dataPath) {
+	printf("Writing ID-name mapping...\n");
+	if(out.format == 1 && out.namesSize > 0xffffffffULL)
+		fail(4, "id_name.bin would exceed 4GB\n");
+	BinaryWriter f;
+	if(!f.open("id_name.bin"))
+		fail(2, "Cannot open id_name.bin\n");
+	if(!out.f_names.close())
+		fail(2, "Error writing %s\n", dataPath);
+	FILE* data = fopen(dataPath, "rb");
+	if(data == NULL)
+		fail(2, "Cannot reopen %s\n", dataPath);
+
+	if(out.format == 2) {
+		// The entries are in ID order, so the lengths give the index
+		uint32_t n = out.currentID;
+		v2_writer w(f, V2_NAMES, n);
+		vector<uint64_t> index(n+2, 0);
+		char name[0x10000];
+		w.section(1);
+		for(uint32_t id=1;id<=n;id++) {
+			uint16_t len = readInt16(data);
+			if(fread(name, 1, len, data) != len)
+				fail(2, "Cannot read %s\n", dataPath);
+			w.write(name, len);
+			index[id+1] = index[id] + len;
+		}
+		w.section(0);
+		w.write(&index[0], 8*index.size());
+		w.close();
+	} else {
+		f.writeInt32(out.currentID);
+		f.writeInt32Array(out.nameOffsets.data() + 1, out.currentID);
+		vector<char> buf(1<<20);
+		size_t n;
+		while((n = fread(&buf[0], 1, buf.size(), data)) > 0)
+			f.write(&buf[0], n);
+	}
+	fclose(data);
+	remove(dataPath);
+	if(!f.close())
+		fail(2, "Error writing id_name.bin\n");
+}
+
+// Size in bytes of a single node's record in name_id.bin
+size_t patriciaRecordSize(ui32patricia::node_type* node) {
+	size_t size = 1 + (node->hasValue ? 4 : 0) + 2;
+	for(uint16_t i=0;i<node->nEdges;i++)
+		size += 2 + node->edges[i]->labelLen + 4;
+	return size;
+}
+
+// First pass of storePatricia: work out the size of every subtree. A node's
+// record holds the offsets of all its children, so the sizes of a node's
+// subtrees are stored together, in the same pre-order in which the second
+// pass reaches them.
+uint64_t measurePatricia(ui32patricia::node_type* node,
+		vector<uint32_t>& childSizes) {
+	uint64_t size = patriciaRecordSize(node);
+	size_t slot = childSizes.size();
+	childSizes.resize(slot + node->nEdges);
+	for(uint16_t i=0;i<node->nEdges;i++) {
+		uint64_t child = measurePatricia(node->edges[i], childSizes);
+		childSizes[slot++] = child;
+		size += child;
+	}
+	return size;
+}
+
+// Second pass: write each node followed by its subtrees. Since every
+// subtree's size is known, the child offsets can be filled in directly and
+// the file comes out in one sequential pass.
+void writePatricia(ui32patricia::node_type* node,
+		const vector<uint32_t>& childSizes, size_t& cursor, uint64_t begin,
+		BinaryWriter& out) {
+	// Write the value, if present
+	out.writeInt8(node->hasValue ? 1 : 0);
+	if(node->hasValue) out.writeInt32(node->value);
+
+	// Store the edge count
+	uint16_t numEdges = node->nEdges;
+	out.writeInt16(numEdges);
+
+	// Write the edges, with the offset of the subtree each one leads to
+	size_t first = cursor;
+	cursor += numEdges;
+	uint64_t child = begin + patriciaRecordSize(node);
+	for(uint16_t i=0;i<numEdges;i++) {
+		ui32patricia::node_type* e = node->edges[i];
+		out.writeInt16(e->labelLen);
+		out.write(e->label, e->labelLen);
+		out.writeInt32(child);
+		child += childSizes[first + i];
 	}
 
 	// Write subnodes
-	for(ui32patricia::edgelist e=node->edges;e != NULL;e=e->next)
-		storePatricia(e->second, relocation, out);
+	child = begin + patriciaRecordSize(node);
+	for(uint16_t i=0;i<numEdges;i++) {
+		writePatricia(node->edges[i], childSizes, cursor, child, out);
+		child += childSizes[first + i];
+	}
+}
+
+// Serialize the trie into name_id.bin. Each node is a value flag byte, the value
+// if present, the edge count as a uint16, and then per edge the label length
+// as a uint16, the label, and the absolute offset of the child node. The
+// root comes first and every node precedes its children.
+void storePatricia(ui32patricia& trie, BinaryWriter& out) {
+	printf("Writing ID trie...\n");
+	vector<uint32_t> childSizes;
+	uint64_t total = measurePatricia(trie.root, childSizes);
+	if(total > 0xffffffffULL)
+		fail(4, "name_id.bin would exceed 4GB\n");
+	size_t cursor = 0;
+	writePatricia(trie.root, childSizes, cursor, 0, out);
+	printf("Wrote %llu bytes of ID trie\n", (unsigned long long)total);
 }
 
+// Gathers every title hash and its ID for the perfect hash
+struct mph_collector {
+	vector<mph_key> keys;
+
+	void operator()(const string& key, uint32_t id) {
+		if(key.empty()) return;
+		mph_key k = {titleHash(key.data(), key.length()), id};
+		keys.push_back(k);
+	}
+};
+
+// Resolves each relocation entry's target title to a page ID. Redirect
+// targets go straight into the redirect table; entries naming no page are
+// dropped.
+struct link_resolver {
+	ui32patricia& ids;
+	vector<uint32_t>& redirectTo;
+	vector<pair<relocation_chunk*, uint32_t> > resolved;
+	size_t unresolved;
+
+	link_resolver(ui32patricia& i, vector<uint32_t>& r) : ids(i),
+			redirectTo(r), unresolved(0) {
+	}
+
+	void operator()(const string& key, relocation_chunk* links) {
+		uint32_t target = ids.lookup(key, 0);
+		if(target == 0) {
+			unresolved += relocationCount(links);
+			return;
+		}
+		for(relocation_chunk* c=links;c != NULL;c = c->prev) {
+			for(uint32_t i=0;i<c->size;i++) {
+				uint32_t l = c->links[i];
+				if(l & RELOCATION_REDIRECT)
+					redirectTo[l & ~RELOCATION_REDIRECT] = target;
+			}
+		}
+		resolved.push_back(make_pair(links, target));
+	}
+};
+
+// Point every redirect straight at the article at the end of its chain.
+// Redirects that loop, or lead to a page that doesn't exist, map to 0.
+// Each redirect is visited once, so this is linear in the number of pages.
+size_t collapseRedirects(const vector<bool>& isRedirect,
+		vector<uint32_t>& redirectTo) {
+	enum { ON_PATH = 1, DONE = 2 };
+	vector<uint8_t> state(redirectTo.size(), 0);
+	vector<uint32_t> path;
+	size_t broken = 0;
+	for(uint32_t id=1;id<redirectTo.size();id++) {
+		if(!isRedirect[id] || state[id] == DONE) continue;
+		path.clear();
+		uint32_t x = id;
+		while(x != 0 && isRedirect[x] && state[x] == 0) {
+			state[x] = ON_PATH;
+			path.push_back(x);
+			x = redirectTo[x];
+		}
+
+		uint32_t final;
+		if(x == 0) final = 0; // Target page doesn't exist
+		else if(!isRedirect[x]) final = x;
+		else if(state[x] == DONE) final = redirectTo[x];
+		else final = 0; // Came back around to the current path
+		for(size_t i=0;i<path.size();i++) {
+			redirectTo[path[i]] = final;
+			state[path[i]] = DONE;
+		}
+		if(final == 0) broken += path.size();
+	}
+	return broken;
+}
+
+// Write redirects.bin: (redirect, article) pairs in ascending ID order
+void writeRedirects(const vector<bool>& isRedirect,
+		const vector<uint32_t>& redirectTo, BinaryWriter& f, int format) {
+	vector<uint32_t> pairs;
+	for(uint32_t id=1;id<redirectTo.size();id++) {
+		if(!isRedirect[id] || redirectTo[id] == 0) continue;
+		pairs.push_back(id);
+		pairs.push_back(redirectTo[id]);
+	}
+	if(format == 2) {
+		v2_writer w(f, V2_REDIRECTS, pairs.size() / 2);
+		w.section(0);
+		w.write(pairs.data(), 4*pairs.size());
+		w.close();
+	} else {
+		f.writeInt32Array(pairs.data(), pairs.size());
+	}
+	printf("Wrote %zu redirects\n", pairs.size() / 2);
+}
+
+// Turn the relocation trie into per-page adjacency lists and write
+// id_links.bin and redirects.bin. Links to redirects are rewritten to the
+// article the redirect ends up at, so the graph only contains articles. The
+// links are bucketed by target and then by source with two counting passes,
+// which leaves every list sorted without a comparison sort, so the whole
+// thing is linear in the number of links.
+void writeLinks(result_target& out) {
+	uint32_t n = out.currentID;
+	vector<uint32_t> redirectTo(n+1, 0);
+	link_resolver resolver(out.idTree, redirectTo);
+	printf("Resolving links...\n");
+	out.relocate.each(resolver);
+	out.relocate.clear();
+	size_t broken = collapseRedirects(out.isRedirect, redirectTo);
+	printf("Collapsed redirects, %zu broken or circular\n", broken);
+	writeRedirects(out.isRedirect, redirectTo, out.f_redirects, out.format);
+
+	// Resolve each target through the redirects and count the links to it
+	vector<uint32_t> count(n+1, 0);
+	for(size_t i=0;i<resolver.resolved.size();i++) {
+		uint32_t& target = resolver.resolved[i].second;
+		if(out.isRedirect[target]) target = redirectTo[target];
+		if(target == 0) continue;
+		for(relocation_chunk* c=resolver.resolved[i].first;c != NULL;c = c->prev)
+			for(uint32_t j=0;j<c->size;j++)
+				if(!(c->links[j] & RELOCATION_REDIRECT)) count[target]++;
+	}
+
+	// Bucket the sources of every link by target
+	vector<uint32_t> start(n+2, 0), pos;
+	for(uint32_t id=1;id<=n;id++) start[id+1] = start[id] + count[id];
+	vector<uint32_t> sources(start[n+1]);
+	pos = start;
+	for(size_t i=0;i<resolver.resolved.size();i++) {
+		uint32_t target = resolver.resolved[i].second;
+		if(target == 0) continue;
+		for(relocation_chunk* c=resolver.resolved[i].first;c != NULL;c = c->prev)
+			for(uint32_t j=0;j<c->size;j++)
+				if(!(c->links[j] & RELOCATION_REDIRECT))
+					sources[pos[target]++] = c->links[j];
+	}
+	vector<pair<relocation_chunk*, uint32_t> >().swap(resolver.resolved);
+	out.relocationArena.clear();
+	printf("Resolved %zu links, %zu unresolved\n", sources.size(),
+			resolver.unresolved);
+
+	// Walk the targets in order and append each to its sources' lists
+	vector<uint32_t> targets(sources.size());
+	fill(count.begin(), count.end(), 0);
+	for(size_t i=0;i<sources.size();i++) count[sources[i]]++;
+	pos[1] = 0;
+	for(uint32_t id=1;id<=n;id++) pos[id+1] = pos[id] + count[id];
+	for(uint32_t target=1;target<=n;target++) {
+		for(uint32_t i=start[target];i<start[target+1];i++)
+			targets[pos[sources[i]]++] = target;
+	}
+	vector<uint32_t>().swap(sources);
+
+	// Drop duplicate links, compacting the lists in place
+	size_t used = 0, begin = 0;
+	for(uint32_t id=1;id<=n;id++) {
+		size_t end = begin + count[id];
+		size_t first = used;
+		for(size_t i=begin;i<end;i++) {
+			if(used > first && targets[used-1] == targets[i]) continue;
+			targets[used++] = targets[i];
+		}
+		count[id] = used - first;
+		begin = end;
+	}
+
+	// Write the offset table followed by the link lists. A v2 file holds the
+	// lists back to back, so they are written in one go.
+	BinaryWriter& f = out.f_links;
+	if(out.format == 2) {
+		v2_writer w(f, V2_LINKS, n);
+		w.section(1);
+		w.write(targets.data(), 4*used);
+		vector<uint64_t> index(n+2, 0);
+		for(uint32_t id=1;id<=n;id++) index[id+1] = index[id] + count[id];
+		w.section(0);
+		w.write(&index[0], 8*index.size());
+		w.close();
+		printf("Wrote %zu links for %u pages\n", used, n);
+		return;
+	}
+	uint64_t offset = 4*((uint64_t)n+1);
+	if(offset + 4*((uint64_t)n + used) > 0xffffffffULL)
+		fail(4, "id_links.bin would exceed 4GB\n");
+	vector<uint32_t> offsets(n+1);
+	offsets[0] = n;
+	for(uint32_t id=1;id<=n;id++) {
+		offsets[id] = offset;
+		offset += 4*(1 + (uint64_t)count[id]);
+	}
+	f.writeInt32Array(offsets.data(), offsets.size());
+	size_t i = 0;
+	for(uint32_t id=1;id<=n;id++) {
+		if(id % 65536 == 0) printf("\rWriting links (%10u)", id);
+		f.writeInt32(count[id]);
+		f.writeInt32Array(targets.data() + i, count[id]);
+		i += count[id];
+	}
+	printf("\rWrote %zu links for %u pages\n", used, n);
+}
+
+// Disk-backed equivalent of writeLinks. The (target hash, source) runs are
+// merge-joined against the sorted (title hash, ID) runs, the resulting
+// (source, target) pairs are sorted on disk again, and id_links.bin is
+// streamed out from that. Redirects are only known completely once the join
+// is over, so each list is passed through them as it is written. Apart from
+// the in-flight buffers, only the offset and redirect tables are held in
+// memory. Titles are matched by 64-bit hash, so the output is identical to
+// the in-memory path barring a hash collision.
+void writeLinksExternal(result_target& out) {
+	uint32_t n = out.currentID;
+	size_t budget = out.memoryBudget/2; // The sorts' half
+	checkTableBudget(out);
+
+	// A sorter that never spilled keeps all of its records for the join, so
+	// if that would leave less than half for the edges, spill them after all
+	if(out.titleRuns->bytes() + out.linkRuns->bytes() > budget/2) {
+		out.titleRuns->checkpoint();
+		out.linkRuns->checkpoint();
+	}
+	printf("Resolving links from %zu + %zu runs...\n", out.titleRuns->runs(),
+			out.linkRuns->runs());
+	out.titleRuns->finish(budget/8);
+	out.linkRuns->finish(budget/8);
+
+	spill_sorter edges("id_links.bin.edges",
+			budget - out.titleRuns->bytes() - out.linkRuns->bytes());
+	vector<uint32_t> redirectTo(n+1, 0);
+	spill_record title, link;
+	bool haveTitle = out.titleRuns->next(title);
+	uint64_t lastHash = 0;
+	uint32_t lastID = 0;
+	size_t unresolved = 0;
+	while(out.linkRuns->next(link)) {
+		// Titles come sorted by (hash, ID), so the first of any duplicate
+		// titles wins, as it does in idTree
+		while(haveTitle && title.key < link.key) {
+			if(lastID == 0 || title.key != lastHash) {
+				lastHash = title.key;
+				lastID = title.value;
+			}
+			haveTitle = out.titleRuns->next(title);
+		}
+		if(haveTitle && title.key == link.key &&
+				(lastID == 0 || title.key != lastHash)) {
+			lastHash = title.key;
+			lastID = title.value;
+		}
+		if(lastID == 0 || lastHash != link.key) {
+			unresolved++;
+			continue;
+		}
+		if(link.pad != 0) {
+			redirectTo[link.value] = lastID;
+			continue;
+		}
+		spill_record e = {((uint64_t)link.value << 32) | lastID, 0, 0};
+		edges.push(e);
+	}
+	delete out.titleRuns;
+	delete out.linkRuns;
+	out.titleRuns = out.linkRuns = NULL;
+	printf("Resolved %llu links, %zu unresolved\n",
+			(unsigned long long)edges.size(), unresolved);
+	size_t broken = collapseRedirects(out.isRedirect, redirectTo);
+	printf("Collapsed redirects, %zu broken or circular\n", broken);
+	writeRedirects(out.isRedirect, redirectTo, out.f_redirects, out.format);
+
+	// Stream the sorted pairs out as lists, leaving room for the offset table.
+	// In a v2 file the index goes after the lists instead.
+	edges.finish(budget/2);
+	BinaryWriter& f = out.f_links;
+	vector<uint32_t> offsets, list;
+	vector<uint64_t> index;
+	v2_writer* w = NULL;
+	uint64_t offset = 4*((uint64_t)n+1);
+	if(out.format == 2) {
+		index.resize(n+2, 0);
+		w = new v2_writer(f, V2_LINKS, n);
+		w->section(1);
+	} else {
+		offsets.resize(n+1);
+		f.skip(offset);
+	}
+	spill_record e;
+	bool haveEdge = edges.next(e);
+	size_t used = 0;
+	for(uint32_t id=1;id<=n;id++) {
+		list.clear();
+		for(;haveEdge && (e.key >> 32) == id;haveEdge = edges.next(e)) {
+			uint32_t target = (uint32_t)e.key;
+			if(out.isRedirect[target]) target = redirectTo[target];
+			if(target != 0) list.push_back(target);
+		}
+		sort(list.begin(), list.end());
+		list.erase(unique(list.begin(), list.end()), list.end());
+		used += list.size();
+		if(id % 65536 == 0) printf("\rWriting links (%10u)", id);
+		if(w != NULL) {
+			index[id+1] = index[id] + list.size();
+			w->write(list.data(), 4*list.size());
+			continue;
+		}
+		if(offset + 4*(1 + (uint64_t)list.size()) > 0xffffffffULL)
+			fail(4, "id_links.bin would exceed 4GB\n");
+		offsets[id] = offset;
+		offset += 4*(1 + (uint64_t)list.size());
+		f.writeInt32(list.size());
+		f.writeInt32Array(list.data(), list.size());
+	}
+	if(w != NULL) {
+		w->section(0);
+		w->write(&index[0], 8*index.size());
+		w->close();
+		delete w;
+	} else {
+		// Patches are raw bytes, so put the table in file order first
+		offsets[0] = n;
+		swap32Array(offsets.data(), offsets.size());
+		f.patch(0, offsets.data(), 4*offsets.size());
+	}
+	printf("\rWrote %zu links for %u pages\n", used, n);
+}
+
+// Copies page lists out of a mapped id_links.bin in either format
+struct mapped_links {
+	const mapped_file& m;
+	const uint64_t* index; // Set for v2 files
+	const uint32_t* targets;
+	uint32_t count;
+
+	mapped_links(const mapped_file& file) : m(file), index(NULL),
+			targets(NULL) {
+		const v2_header* h = v2Header(m, V2_LINKS);
+		if(h != NULL) {
+			count = h->count;
+			index = v2Section<uint64_t>(m, h, 0);
+			targets = v2Section<uint32_t>(m, h, 1);
+		} else {
+			count = m.int32At(0);
+		}
+	}
+
+	void get(uint32_t id, vector<uint32_t>& out) const {
+		if(index != NULL) {
+			out.assign(targets + index[id], targets + index[id+1]);
+		} else {
+			size_t p = m.int32At(4*(size_t)id);
+			out.resize(m.int32At(p));
+			decodeInt32Array(m.data + p + 4, out.data(), out.size());
+		}
+	}
+};
+
+// Write id_inlinks.bin, the transpose of the id_links.bin just written: for
+// every page, the pages that link to it, in the same format. It's read back
+// from the file so that both ways of writing the links share it. The sources
+// are bucketed by target after counting them, a range of targets at a time
+// if there is a memory budget, with a pass over the links for each range.
+// The sources of a range use at most the half of the budget that the sorts
+// had. Sources are visited in order, so the lists come out sorted.
+void writeInlinks(int format, size_t budget) {
+	mapped_file m;
+	if(!m.map("id_links.bin"))
+		fail(2, "Cannot open id_links.bin\n");
+	m.adviseSequential();
+	mapped_links links(m);
+	uint32_t n = links.count;
+	BinaryWriter f;
+	if(!f.open("id_inlinks.bin"))
+		fail(2, "Cannot open id_inlinks.bin\n");
+
+	vector<uint32_t> count(n+2, 0), list;
+	for(uint32_t id=1;id<=n;id++) {
+		links.get(id, list);
+		for(size_t i=0;i<list.size();i++) count[list[i]]++;
+	}
+
+	// Both formats know where every list goes before any is written
+	vector<uint64_t> index(n+2, 0);
+	for(uint32_t id=1;id<=n;id++) index[id+1] = index[id] + count[id];
+	v2_writer* w = NULL;
+	if(format == 2) {
+		w = new v2_writer(f, V2_INLINKS, n);
+		w->section(1);
+	} else {
+		uint64_t offset = 4*((uint64_t)n+1);
+		if(offset + 4*((uint64_t)n + index[n+1]) > 0xffffffffULL)
+			fail(4, "id_inlinks.bin would exceed 4GB\n");
+		vector<uint32_t> offsets(n+1);
+		offsets[0] = n;
+		for(uint32_t id=1;id<=n;id++) {
+			offsets[id] = offset;
+			offset += 4*(1 + (uint64_t)count[id]);
+		}
+		f.writeInt32Array(offsets.data(), offsets.size());
+	}
+
+	size_t slice = budget > 0 ? max<size_t>(budget/2 / 4, 1) : ~(size_t)0;
+	vector<uint32_t> sources;
+	vector<uint64_t> pos;
+	int passes = 0;
+	for(uint32_t lo=1;lo<=n;passes++) {
+		// Take targets while their sources fit, and at least one
+		uint32_t hi = lo + 1;
+		while(hi <= n && index[hi+1] - index[lo] <= slice) hi++;
+		sources.resize(index[hi] - index[lo]);
+		pos.assign(index.begin() + lo, index.begin() + hi);
+		for(uint32_t id=1;id<=n;id++) {
+			links.get(id, list);
+			vector<uint32_t>::iterator t = lower_bound(list.begin(),
+					list.end(), lo);
+			for(;t != list.end() && *t < hi;t++)
+				sources[pos[*t - lo]++ - index[lo]] = id;
+		}
+
+		if(w != NULL) {
+			w->write(sources.data(), 4*sources.size());
+		} else {
+			for(uint32_t id=lo;id<hi;id++) {
+				f.writeInt32(count[id]);
+				f.writeInt32Array(sources.data() + (index[id] - index[lo]),
+						count[id]);
+			}
+		}
+		lo = hi;
+	}
+	if(w != NULL) {
+		w->section(0);
+		w->write(&index[0], 8*index.size());
+		w->close();
+		delete w;
+	}
+	if(!f.close())
+		fail(2, "Error writing id_inlinks.bin\n");
+	printf("Wrote reverse links in %d pass%s\n", passes,
+			passes == 1 ? "" : "es");
+}
+
+// What the XML reader reads: the decompressed dump, after some text of our
+// own when resuming partway through
+struct xml_input {
+	io::filtering_streambuf<io::input>* file;
+	const char* prefix;
+};
+
 int boost_stream_read_callback(void* ctx, char* buf, int len) {
-	io::filtering_streambuf<io::input>* p =
-		(io::filtering_streambuf<io::input>*)ctx;
-	return io::read(*p, buf, len);
+	xml_input* in = (xml_input*)ctx;
+	if(*in->prefix != '\0') {
+		int n = min<size_t>(len, strlen(in->prefix));
+		memcpy(buf, in->prefix, n);
+		in->prefix += n;
+		return n;
+	}
+	// io::read signals EOF with -1, which libxml would take as an error
+	std::streamsize n = io::read(*in->file, buf, len);
+	return (n < 0) ? 0 : n;
 }
 
 int boost_stream_close_callback(void* ctx) {
-	io::filtering_streambuf<io::input>* p =
-		(io::filtering_streambuf<io::input>*)ctx;
-	io::close(*p);
+	io::close(*((xml_input*)ctx)->file);
 	return 0;
 }
 
-void fail(int n, const char* msg, ...) {
-	va_list v;
-	va_start(v, msg);
-	vfprintf(stderr, msg, v);
-	va_end(v);
-	exit(n);
+// Take a string from the reader, which the frame then holds a copy of
+static void takeString(xmlChar* s, string& out, bool& has) {
+	has = s != NULL;
+	if(s == NULL) return;
+	out.assign((const char*)s);
+	xmlFree(s);
 }
 
-int main(int argc, char **argv) {
-	if(argc != 2)
-		fail(1, "Usage: %s [compressed database file]\n", argv[0]);
-	LIBXML_TEST_VERSION
-
-	// Open the file and start parsing XML
-	ifstream inStream(argv[1], ios_base::in | ios_base::binary);
-	io::filtering_streambuf<io::input> file;
-	file.push(io::bzip2_decompressor());
-	file.push(inStream);
-
+// Pull pages out of the dump with xmlTextReader, and hand each complete one
+// to the extraction workers. Returns the number of pages read.
+uint64_t readPages(xml_input& input, frame_pool& pool,
+		BoundedQueue<parse_frame*>& frames) {
 	xmlTextReaderPtr reader = xmlReaderForIO(
 			boost_stream_read_callback, boost_stream_close_callback,
-			&file, "", NULL, 0);
+			&input, "", NULL, 0);
 	if(reader == NULL)
 		fail(1, "Cannot create XML reader\n");
 
-	// Open output files
-	result_target target;
-	target.f_ids = fopen("ids.bin", "wb");
-	target.f_names = fopen("names.bin", "wb");
-	target.f_links = fopen("links.bin", "wb");
-	if(target.f_ids == NULL)
-		fail(2, "Cannot open ids.bin\n");
-	if(target.f_names == NULL)
-		fail(2, "Cannot open names.bin\n");
-	if(target.f_links == NULL)
-		fail(2, "Cannot open links.bin\n");
-
-	// Process the file, and build the necessary mappings. While elements are
-	// processed, add complete pages to the name->id map, and write the names
-	// out to a file, saving the associated positions.
-	parse_frame active_frame;
-	bool parsing_frame = false;
-
-	target.currentID = 0;
-	int ret;
-	while((ret = xmlTextReaderRead(reader)) == 1) {
+	parse_frame* active_frame = NULL;
+	uint64_t nFrames = 0;
+	while(xmlTextReaderRead(reader) == 1) {
 		// Process a node and print it
 		const xmlChar* localname = xmlTextReaderConstLocalName(reader);
 		int nodeType = xmlTextReaderNodeType(reader);
@@ -211,43 +1148,641 @@ int main(int argc, char **argv) {
 			is_begin = nodeType == XML_READER_TYPE_ELEMENT;
 
 		if(xmlStrEqual(localname, BAD_CAST "page")) {
-			if(is_end && parsing_frame) {
+			if(is_end && active_frame != NULL) {
 				// Check if we have an active frame, and complete it if so
-				processFrame(active_frame, target);
-				parsing_frame = false;
+				active_frame->seq = nFrames++;
+				frames.put(active_frame);
+				active_frame = NULL;
 			} else if(is_begin) {
-				// Clean up the active frame for the new page
-				parsing_frame = true;
-				active_frame.redirect = false;
-				if(active_frame.title != NULL) {
-					xmlFree(active_frame.title);
-					active_frame.title = NULL;
-				}
-				if(active_frame.content != NULL) {
-					xmlFree(active_frame.content);
-					active_frame.content = NULL;
-				}
+				// Start a fresh frame for the new page
+				if(active_frame != NULL) pool.put(active_frame);
+				active_frame = pool.get();
 			}
+		} else if(active_frame == NULL) {
+			continue;
 		} else if(xmlStrEqual(localname, BAD_CAST "title")) { // Title
 			if(is_end) continue;
-			active_frame.title = xmlTextReaderReadString(reader);
+			takeString(xmlTextReaderReadString(reader), active_frame->title,
+					active_frame->hasTitle);
 		} else if(xmlStrEqual(localname, BAD_CAST "redirect")) { // Redirect
 			if(is_end) continue;
-			active_frame.redirect = true;
-			active_frame.content = xmlTextReaderGetAttributeNo(reader, 0);
+			active_frame->redirect = true;
+			active_frame->content.clear();
+			takeString(xmlTextReaderGetAttributeNo(reader, 0),
+					active_frame->content, active_frame->hasContent);
 		} else if(xmlStrEqual(localname, BAD_CAST "text")) { // Text
-			if(is_end || active_frame.redirect) continue;
-			if(active_frame.content != NULL) continue;
-			active_frame.content = xmlTextReaderReadString(reader);
+			if(is_end || active_frame->redirect) continue;
+			if(active_frame->hasContent) continue;
+			takeString(xmlTextReaderReadString(reader), active_frame->content,
+					active_frame->hasContent);
+		}
+	}
+	if(active_frame != NULL) pool.put(active_frame);
+	xmlFreeTextReader(reader);
+	return nFrames;
+}
+
+// State of the SAX parser. The element names it cares about are interned in
+// the parser's dictionary, which the names it reports come from as well, so
+// they can be told apart by pointer.
+struct sax_state {
+	const xmlChar *page, *title, *redirect, *text;
+	frame_pool* pool;
+	BoundedQueue<parse_frame*>* frames;
+	parse_frame* frame; // The page being read, if any
+	const xmlChar* capturing; // The element whose text is being collected
+	string* capture; // and where it goes
+	uint64_t nFrames;
+};
+
+static void saxStartElement(void* ctx, const xmlChar* localname,
+		const xmlChar* /*prefix*/, const xmlChar* /*URI*/,
+		int /*nNamespaces*/, const xmlChar** /*namespaces*/, int nAttributes,
+		int /*nDefaulted*/, const xmlChar** attributes) {
+	sax_state* s = (sax_state*)ctx;
+	if(localname == s->page) {
+		if(s->frame != NULL) s->pool->put(s->frame);
+		s->frame = s->pool->get();
+		s->capture = NULL;
+		return;
+	}
+	parse_frame* frame = s->frame;
+	if(frame == NULL) return;
+	if(localname == s->title) {
+		frame->hasTitle = true;
+		frame->title.clear();
+		s->capturing = localname;
+		s->capture = &frame->title;
+	} else if(localname == s->redirect) {
+		// Attributes come as (name, prefix, URI, value, end of value)
+		frame->redirect = true;
+		frame->hasContent = nAttributes > 0;
+		frame->content.clear();
+		if(nAttributes > 0)
+			frame->content.assign((const char*)attributes[3],
+					attributes[4] - attributes[3]);
+	} else if(localname == s->text) {
+		if(frame->redirect || frame->hasContent) return;
+		frame->hasContent = true;
+		s->capturing = localname;
+		s->capture = &frame->content;
+	}
+}
+
+static void saxEndElement(void* ctx, const xmlChar* localname,
+		const xmlChar* /*prefix*/, const xmlChar* /*URI*/) {
+	sax_state* s = (sax_state*)ctx;
+	if(localname == s->capturing) {
+		s->capturing = NULL;
+		s->capture = NULL;
+	}
+	if(localname == s->page && s->frame != NULL) {
+		s->frame->seq = s->nFrames++;
+		s->frames->put(s->frame);
+		s->frame = NULL;
+	}
+}
+
+static void saxCharacters(void* ctx, const xmlChar* ch, int len) {
+	sax_state* s = (sax_state*)ctx;
+	if(s->capture != NULL) s->capture->append((const char*)ch, len);
+}
+
+// Same as readPages, but with a SAX2 parser. The text of a page is appended
+// straight into the frame as the parser delivers it, rather than the reader
+// collecting it into a string of its own that is then copied.
+uint64_t saxPages(xml_input& input, frame_pool& pool,
+		BoundedQueue<parse_frame*>& frames) {
+	xmlSAXHandler handler;
+	memset(&handler, 0, sizeof(handler));
+	handler.initialized = XML_SAX2_MAGIC;
+	handler.startElementNs = saxStartElement;
+	handler.endElementNs = saxEndElement;
+	handler.characters = saxCharacters;
+	handler.ignorableWhitespace = saxCharacters;
+	handler.cdataBlock = saxCharacters;
+
+	sax_state state;
+	memset(&state, 0, sizeof(state));
+	state.pool = &pool;
+	state.frames = &frames;
+	xmlParserCtxtPtr ctxt = xmlCreateIOParserCtxt(&handler, &state,
+			boost_stream_read_callback, boost_stream_close_callback, &input,
+			XML_CHAR_ENCODING_NONE);
+	if(ctxt == NULL)
+		fail(1, "Cannot create XML parser\n");
+	state.page = xmlDictLookup(ctxt->dict, BAD_CAST "page", -1);
+	state.title = xmlDictLookup(ctxt->dict, BAD_CAST "title", -1);
+	state.redirect = xmlDictLookup(ctxt->dict, BAD_CAST "redirect", -1);
+	state.text = xmlDictLookup(ctxt->dict, BAD_CAST "text", -1);
+
+	xmlParseDocument(ctxt);
+	if(state.frame != NULL) pool.put(state.frame);
+	if(ctxt->myDoc != NULL) xmlFreeDoc(ctxt->myDoc);
+	xmlFreeParserCtxt(ctxt);
+	return state.nFrames;
+}
+
+// Open the database that an overlay is built on, and pick up the overlay that
+// is already there, if any, so the new one can replace it
+void loadDeltaBase(delta_target& d) {
+	name_table names;
+	try {
+		if(!names.open("id_name.bin"))
+			fail(2, "Cannot open id_name.bin\n");
+		if(!d.baseRedirects.open("redirects.bin"))
+			fail(2, "Cannot open redirects.bin\n");
+	} catch(runtime_error& e) {
+		fail(2, "%s\n", e.what());
+	}
+	d.baseCount = names.count();
+	if(!d.baseIds.map("name_id.bin"))
+		fail(2, "Cannot open name_id.bin\n");
+	d.nextID = d.baseCount + 1;
+
+	try {
+		if(!d.previous.load()) return;
+	} catch(runtime_error& e) {
+		fail(2, "%s\n", e.what());
+	}
+	if(d.previous.firstID() != d.baseCount + 1)
+		fail(2, "The existing overlay doesn't belong to this database\n");
+	string name, key;
+	for(uint32_t i=0;i<d.previous.count();i++) {
+		uint32_t id = d.previous.firstID() + i;
+		d.previous.name(id, name);
+		normalizeTitle(name.data(), name.length(), key);
+		d.newTitles.insert(key, id);
+		d.newNames.push_back(name);
+	}
+	d.nextID += d.previous.count();
+	printf("Extending overlay with %u added pages\n", d.previous.count());
+}
+
+uint32_t deltaTitle(delta_target& d, const string& key) {
+	uint32_t id = d.newTitles.lookup(key, 0);
+	return (id != 0) ? id : lookupName(d.baseIds, key);
+}
+
+// The page a page redirects to once the delta is applied, or 0 if it's an
+// article. The delta wins over the old overlay, which wins over the base.
+uint32_t deltaRedirectStep(delta_target& d, uint32_t id) {
+	map<uint32_t, delta_page>::iterator p = d.pages.find(id);
+	if(p != d.pages.end())
+		return p->second.redirect ? p->second.redirectTo : 0;
+	uint32_t target;
+	if(d.previous.redirect(id, target)) return target;
+	if(d.baseRedirects.lookup(id, target)) return target;
+	return 0;
+}
+
+// Follow a page through redirects to an article, or return 0 if they loop
+uint32_t deltaArticle(delta_target& d, uint32_t id) {
+	for(int step=0;step<64;step++) {
+		uint32_t next = deltaRedirectStep(d, id);
+		if(next == 0) return id;
+		id = next;
+	}
+	return 0;
+}
+
+void openDeltaFile(BinaryWriter& f, const string& path) {
+	if(!f.open(path.c_str()))
+		fail(2, "Cannot open %s\n", path.c_str());
+}
+
+void closeDeltaFile(BinaryWriter& f, const string& path) {
+	if(!f.close())
+		fail(2, "Error writing %s\n", path.c_str());
+}
+
+// Write the overlay for everything read from the delta, merged with the old
+// overlay. The files are written under temporary names and only renamed into
+// place once all of them are complete, since the old ones are still mapped.
+void writeDelta(delta_target& d) {
+	printf("\nResolving %zu changed pages...\n", d.pages.size());
+	map<uint32_t, delta_page>::iterator p;
+	for(p=d.pages.begin();p != d.pages.end();p++) {
+		if(p->second.redirect && !p->second.targets.empty())
+			p->second.redirectTo = deltaTitle(d, p->second.targets[0]);
+	}
+
+	// Link lists of the changed pages, and of pages from the old overlay that
+	// didn't change, resolved again in case their targets did
+	map<uint32_t, vector<uint32_t> > links;
+	size_t unresolved = 0;
+	for(p=d.pages.begin();p != d.pages.end();p++) {
+		vector<uint32_t>& list = links[p->first];
+		if(p->second.redirect) continue;
+		for(size_t i=0;i<p->second.targets.size();i++) {
+			uint32_t id = deltaTitle(d, p->second.targets[i]);
+			if(id != 0) id = deltaArticle(d, id);
+			if(id == 0) unresolved++;
+			else list.push_back(id);
 		}
 	}
+	for(uint32_t i=0;i<d.previous.linkEntries();i++) {
+		uint32_t id = d.previous.linkEntryID(i);
+		if(d.pages.count(id)) continue;
+		vector<uint32_t>& list = links[id];
+		d.previous.links(id, list);
+		for(size_t j=0;j<list.size();j++) list[j] = deltaArticle(d, list[j]);
+	}
+	map<uint32_t, vector<uint32_t> >::iterator l;
+	for(l=links.begin();l != links.end();l++) {
+		vector<uint32_t>& list = l->second;
+		sort(list.begin(), list.end());
+		list.erase(unique(list.begin(), list.end()), list.end());
+		if(!list.empty() && list[0] == 0) list.erase(list.begin());
+	}
+
+	// Redirects of the changed pages. Pages that stopped being a redirect
+	// get a target of 0 to hide the old entry.
+	map<uint32_t, uint32_t> redirects;
+	for(p=d.pages.begin();p != d.pages.end();p++) {
+		uint32_t id = p->first, target;
+		if(p->second.redirect) {
+			target = deltaArticle(d, id);
+			redirects[id] = (target == id) ? 0 : target;
+		} else if(d.previous.redirect(id, target) ||
+				d.baseRedirects.lookup(id, target)) {
+			redirects[id] = 0;
+		}
+	}
+	for(uint32_t i=0;i<d.previous.redirectEntries();i++) {
+		uint32_t id = d.previous.redirectEntryID(i);
+		if(d.pages.count(id)) continue;
+		uint32_t target = deltaArticle(d, id);
+		redirects[id] = (target == id) ? 0 : target;
+	}
+
+	// Names of the added pages
+	string namesPath = "delta_id_name.bin.tmp";
+	BinaryWriter f;
+	openDeltaFile(f, namesPath);
+	f.writeInt32(d.baseCount + 1);
+	f.writeInt32(d.newNames.size());
+	uint32_t offset = 0;
+	for(size_t i=0;i<d.newNames.size();i++) {
+		f.writeInt32(offset);
+		offset += 2 + min<size_t>(d.newNames[i].length(), 0xffff);
+	}
+	for(size_t i=0;i<d.newNames.size();i++) {
+		uint16_t len = min<size_t>(d.newNames[i].length(), 0xffff);
+		f.writeInt16(len);
+		f.write(d.newNames[i].data(), len);
+	}
+	closeDeltaFile(f, namesPath);
+
+	string idsPath = "delta_name_id.bin.tmp";
+	openDeltaFile(f, idsPath);
+	storePatricia(d.newTitles, f);
+	closeDeltaFile(f, idsPath);
+
+	// Link lists, found through a table of (page, offset) sorted by page
+	string linksPath = "delta_links.bin.tmp";
+	openDeltaFile(f, linksPath);
+	uint64_t listOffset = 4 + 8*(uint64_t)links.size();
+	size_t nLinks = 0;
+	f.writeInt32(links.size());
+	for(l=links.begin();l != links.end();l++) {
+		f.writeInt32(l->first);
+		f.writeInt32(listOffset);
+		listOffset += 4*(1 + (uint64_t)l->second.size());
+	}
+	if(listOffset > 0xffffffffULL)
+		fail(4, "delta_links.bin would exceed 4GB\n");
+	for(l=links.begin();l != links.end();l++) {
+		f.writeInt32(l->second.size());
+		f.writeInt32Array(l->second.data(), l->second.size());
+		nLinks += l->second.size();
+	}
+	closeDeltaFile(f, linksPath);
+
+	string redirectsPath = "delta_redirects.bin.tmp";
+	openDeltaFile(f, redirectsPath);
+	map<uint32_t, uint32_t>::iterator r;
+	for(r=redirects.begin();r != redirects.end();r++) {
+		f.writeInt32(r->first);
+		f.writeInt32(r->second);
+	}
+	closeDeltaFile(f, redirectsPath);
+
+	const string paths[] = {namesPath, idsPath, linksPath, redirectsPath};
+	for(int i=0;i<4;i++) {
+		string final = paths[i].substr(0, paths[i].length() - 4);
+		if(rename(paths[i].c_str(), final.c_str()) != 0)
+			fail(2, "Cannot replace %s\n", final.c_str());
+	}
+	printf("Overlay has %zu added pages, %zu link lists with %zu links "
+			"(%zu unresolved) and %zu redirect entries\n", d.newNames.size(),
+			links.size(), nLinks, unresolved, redirects.size());
+}
+
+static const struct option longOptions[] = {
+	{"threads", required_argument, NULL, 'j'},
+	{"memory-budget", required_argument, NULL, 'm'},
+	{"mphf", no_argument, NULL, 'H'},
+	{"incremental", no_argument, NULL, 'I'},
+	{"checkpoint", required_argument, NULL, 'c'},
+	{"resume", no_argument, NULL, 'R'},
+	{"format", required_argument, NULL, 'F'},
+	{"parser", required_argument, NULL, 'P'},
+	{"content", no_argument, NULL, 'C'},
+	{NULL, 0, NULL, 0}
+};
+
+void usage(const char* name) {
+	fail(1, "Usage: %s [-j threads] [--memory-budget=SIZE[KMG]] [--mphf] "
+			"[--incremental] [--checkpoint=PAGES] [--resume] [--format=1|2] "
+			"[--parser=reader|sax] [--content] "
+			"[compressed database file]\n\n"
+			"--memory-budget bounds the link sorts, which spill to disk, and the\n"
+			"title trie and page tables, which must fit in half of it or the run\n"
+			"stops. Decompression and parsing buffers come on top of it.\n", name);
+}
+
+// Parse a size such as "512M" or "4G" into bytes, or return 0 if invalid
+size_t parseSize(const char* s) {
+	char* end;
+	double v = strtod(s, &end);
+	switch(toupper(*end)) {
+		case 'G': v *= 1024; // fall through
+		case 'M': v *= 1024; // fall through
+		case 'K': v *= 1024; end++; // fall through
+		case '\0': break;
+		default: return 0;
+	}
+	if(*end != '\0' || v < 0) return 0;
+	return (size_t)v;
+}
+
+int main(int argc, char **argv) {
+	int threads = boost::thread::hardware_concurrency();
+	size_t memoryBudget = 0;
+	bool buildMphf = false, incremental = false, resume = false;
+	uint64_t checkpointInterval = 0;
+	int format = 1;
+	bool useSax = false, storeContent = false;
+	int opt;
+	while((opt = getopt_long(argc, argv, "j:m:c:", longOptions, NULL)) != -1) {
+		switch(opt) {
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			case 'm':
+				memoryBudget = parseSize(optarg);
+				if(memoryBudget < (16<<20))
+					fail(1, "Memory budget must be at least 16M\n");
+				break;
+			case 'H':
+				buildMphf = true;
+				break;
+			case 'I':
+				incremental = true;
+				break;
+			case 'c':
+				checkpointInterval = strtoull(optarg, NULL, 10);
+				if(checkpointInterval == 0)
+					fail(1, "Checkpoint interval must be a number of pages\n");
+				break;
+			case 'R':
+				resume = true;
+				break;
+			case 'C':
+				storeContent = true;
+				break;
+			case 'P':
+				if(strcmp(optarg, "sax") == 0) useSax = true;
+				else if(strcmp(optarg, "reader") == 0) useSax = false;
+				else fail(1, "Parser must be reader or sax\n");
+				break;
+			case 'F':
+				format = atoi(optarg);
+				if(format != 1 && format != 2)
+					fail(1, "Format must be 1 or 2\n");
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if(optind != argc-1) usage(argv[0]);
+	if(incremental && (memoryBudget > 0 || buildMphf))
+		fail(1, "--incremental can't be combined with --memory-budget or "
+				"--mphf\n");
+	if(incremental && format != 1)
+		fail(1, "--incremental only writes the overlay, which has no "
+				"--format\n");
+	if(incremental && (resume || checkpointInterval > 0))
+		fail(1, "--incremental doesn't take checkpoints\n");
+	if(storeContent && (incremental || resume || checkpointInterval > 0))
+		fail(1, "--content can't be combined with --incremental or "
+				"checkpoints\n");
+	const char* inPath = argv[optind];
+	LIBXML_TEST_VERSION
+
+	// Checkpoints only work on multistream input, which can be restarted at
+	// any stream boundary
+	uint64_t inputSize = 0;
+	FILE* in = fopen(inPath, "rb");
+	if(in != NULL) {
+		fseeko(in, 0, SEEK_END);
+		inputSize = ftello(in);
+		fclose(in);
+	}
+	bool multistream = bz2_is_multistream(inPath);
+	if((resume || checkpointInterval > 0) && !multistream)
+		fail(1, "Checkpoints need a multistream dump\n");
+	FILE* checkpoint = NULL;
+	checkpoint_header resumeFrom;
+	if(resume) {
+		checkpoint = fopen(CHECKPOINT_FILE, "rb");
+		if(checkpoint == NULL)
+			fail(1, "No checkpoint to resume from\n");
+		if(!readCheckpointHeader(checkpoint, resumeFrom))
+			fail(1, "%s is damaged\n", CHECKPOINT_FILE);
+		if(resumeFrom.inputSize != inputSize)
+			fail(1, "%s was taken on a different dump\n", CHECKPOINT_FILE);
+		memoryBudget = resumeFrom.memoryBudget;
+		printf("Resuming after %llu pages\n",
+				(unsigned long long)resumeFrom.pages);
+	}
+
+	// Open the file and start parsing XML. Multistream dumps are split at
+	// their bzip2 stream boundaries and decompressed in parallel; anything
+	// else goes through the ordinary single-threaded decompressor.
+	ifstream inStream;
+	io::filtering_streambuf<io::input> file;
+	bz2_parallel_source* parallel = NULL;
+	if(multistream) {
+		parallel = new bz2_parallel_source(inPath, threads, 1<<20,
+				resume ? resumeFrom.offset : 0);
+		if(!parallel->good())
+			fail(1, "Cannot open %s\n", inPath);
+		file.push(*parallel);
+	} else {
+		inStream.open(inPath, ios_base::in | ios_base::binary);
+		if(!inStream)
+			fail(1, "Cannot open %s\n", inPath);
+		file.push(io::bzip2_decompressor());
+		file.push(inStream);
+	}
+
+	// The root element was left behind with the first stream, so a resumed
+	// run puts it back before the remaining pages
+	xml_input input = {&file, resume ? "<mediawiki>" : ""};
+
+	// Open output files. An incremental run leaves the database alone and
+	// only writes the overlay at the end.
+	result_target target;
+	const char* namesData = "id_name.bin.data";
+	target.delta = NULL;
+	if(incremental) {
+		target.delta = new delta_target();
+		loadDeltaBase(*target.delta);
+	} else {
+		if(!target.f_ids.open("name_id.bin"))
+			fail(2, "Cannot open name_id.bin\n");
+		if(resume ? !target.f_names.reopen(namesData, resumeFrom.namesSize) :
+				!target.f_names.open(namesData))
+			fail(2, "Cannot open %s\n", namesData);
+		if(!target.f_links.open("id_links.bin"))
+			fail(2, "Cannot open id_links.bin\n");
+		if(!target.f_redirects.open("redirects.bin"))
+			fail(2, "Cannot open redirects.bin\n");
+		if(!storeContent) remove("contents.bin");
+
+		// An overlay only makes sense on the database it was built against
+		const char* overlay[] = {"delta_id_name.bin", "delta_name_id.bin",
+			"delta_links.bin", "delta_redirects.bin"};
+		for(int i=0;i<4;i++) remove(overlay[i]);
+	}
+
+	// Process the file, and build the necessary mappings. While elements are
+	// processed, add complete pages to the name->id map, and write the names
+	// out to a file, saving the associated positions.
+	if(threads < 1) threads = 1;
+	target.content = NULL;
+	if(storeContent) {
+		target.content = new ContentWriter(threads);
+		if(!target.content->open("contents.bin"))
+			fail(2, "Cannot open contents.bin\n");
+	}
+	BoundedQueue<parse_frame*> frames(4*threads);
+	OrderedQueue<parse_frame*> extracted(16*threads);
+	vector<boost::thread*> extractors;
+	for(int i=0;i<threads;i++)
+		extractors.push_back(new boost::thread(extractorThread, &frames,
+					&extracted));
+	target.currentID = 0;
+	target.format = format;
+	target.isRedirect.push_back(false);
+	target.nameOffsets.push_back(0);
+	target.namesSize = 0;
+	target.memoryBudget = memoryBudget;
+	target.laterBytesPerPage = 0;
+	target.titleRuns = target.linkRuns = NULL;
+	if(memoryBudget > 0) {
+		// The redirect and offset tables, the reverse link counts and
+		// index, or the title hash's keys and levels, whichever is biggest
+		target.laterBytesPerPage = buildMphf ? 48 : 24;
+		target.titleRuns = new spill_sorter("id_links.bin.titles",
+				memoryBudget/6);
+		target.linkRuns = new spill_sorter("id_links.bin.links",
+				memoryBudget/3);
+	}
+	if(resume) {
+		try {
+			if(target.titleRuns != NULL) {
+				target.titleRuns->adopt(resumeFrom.titleRuns,
+						resumeFrom.titleCount);
+				target.linkRuns->adopt(resumeFrom.linkRuns,
+						resumeFrom.linkCount);
+			}
+		} catch(runtime_error& e) {
+			fail(1, "%s\n", e.what());
+		}
+		readCheckpointState(checkpoint, resumeFrom, target);
+		fclose(checkpoint);
+	}
+	target.ckpt = NULL;
+	if(checkpointInterval > 0) {
+		target.ckpt = new checkpoint_state();
+		target.ckpt->source = parallel;
+		target.ckpt->interval = checkpointInterval;
+		target.ckpt->pagesBase = resume ? resumeFrom.pages : 0;
+		target.ckpt->last = 0;
+		target.ckpt->inputSize = inputSize;
+	}
+	frame_pool pool;
+	boost::thread writer(writerThread, &extracted, &target, &pool);
+
+	if(useSax) saxPages(input, pool, frames);
+	else readPages(input, pool, frames);
+
+	// Drain the pipeline
+	frames.close();
+	for(size_t i=0;i<extractors.size();i++) {
+		extractors[i]->join();
+		delete extractors[i];
+	}
+	extracted.close();
+	writer.join();
+	if(parallel != NULL && parallel->failed())
+		fail(3, "\nCorrupt or truncated bzip2 stream in %s\n", inPath);
+	if(parallel != NULL) {
+		// Drop both copies of the source so its threads are joined
+		file.reset();
+		delete parallel;
+	}
 	printf("\nParsing complete\n");
+	if(target.content != NULL) {
+		if(!target.content->close())
+			fail(2, "Error writing contents.bin\n");
+		delete target.content;
+		printf("Stored article text in contents.bin\n");
+	}
+	if(target.delta != NULL) {
+		writeDelta(*target.delta);
+		delete target.delta;
+		xmlCleanupParser();
+		return 0;
+	}
 
 	// Now that link and name mappings are done, postprocess the link maps into
 	// their final form
-	map<ui32patricia::node_type*, size_t> relocationTable;
-	storePatricia(target.idTree.root, relocationTable, target.f_ids);
+	if(target.linkRuns != NULL)
+		writeLinksExternal(target);
+	else
+		writeLinks(target);
+	if(!target.f_links.close())
+		fail(2, "Error writing id_links.bin\n");
+	if(!target.f_redirects.close())
+		fail(2, "Error writing redirects.bin\n");
+	writeInlinks(format, memoryBudget);
+	writeNames(target, namesData);
+	storePatricia(target.idTree, target.f_ids);
+	if(!target.f_ids.close())
+		fail(2, "Error writing name_id.bin\n");
+
+	// Optionally add a perfect hash over the same titles. A stale one would
+	// give wrong IDs, so it is removed when not rebuilt.
+	if(buildMphf) {
+		printf("Building title hash...\n");
+		mph_collector keys;
+		target.idTree.each(keys);
+		BinaryWriter f_mph;
+		if(!f_mph.open("name_mph.bin"))
+			fail(2, "Cannot open name_mph.bin\n");
+		writeMphf(keys.keys, threads, f_mph);
+		if(!f_mph.close())
+			fail(2, "Error writing name_mph.bin\n");
+	} else {
+		remove("name_mph.bin");
+	}
 
+	// The run is complete, so there is nothing left to resume
+	remove(CHECKPOINT_FILE);
 	xmlCleanupParser();
 	return 0;
 }
@@ -1,6 +1,8 @@
 #pragma once
 #include <boost/thread.hpp>
+#include <stdint.h>
 #include <queue>
+#include <map>
 #include <stdexcept>
 
 /** \brief A thread-safe wrapper for std::queue
@@ -82,3 +84,105 @@ private:
 	std::queue<T> m_entry;
 };
 
+
+/** \brief A blocking, capacity-limited FIFO for handing work between threads
+ * \tparam T The class type contained within
+ *
+ * put() blocks while the queue is full and get() blocks while it is empty.
+ * After close() has been called, get() drains whatever is left and then
+ * returns false, which lets consumers exit cleanly.
+ */
+template<class T>
+struct BoundedQueue {
+	BoundedQueue(size_t capacity) : m_capacity(capacity), m_closed(false) {
+	}
+
+	void put(const T& obj) {
+		boost::unique_lock<boost::mutex> lock(m_mutex);
+		while(m_entry.size() >= m_capacity && !m_closed) m_notFull.wait(lock);
+		m_entry.push(obj);
+		m_notEmpty.notify_one();
+	}
+
+	bool get(T& out) {
+		boost::unique_lock<boost::mutex> lock(m_mutex);
+		while(m_entry.empty() && !m_closed) m_notEmpty.wait(lock);
+		if(m_entry.empty()) return false;
+		out = m_entry.front();
+		m_entry.pop();
+		m_notFull.notify_one();
+		return true;
+	}
+
+	void close() {
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		m_closed = true;
+		m_notEmpty.notify_all();
+		m_notFull.notify_all();
+	}
+
+private:
+	BoundedQueue(BoundedQueue<T>& q) {
+	}
+
+	size_t m_capacity;
+	bool m_closed;
+	boost::mutex m_mutex;
+	boost::condition_variable m_notEmpty, m_notFull;
+	std::queue<T> m_entry;
+};
+
+/** \brief Reassembles items tagged with sequence numbers into their order
+ * \tparam T The class type contained within
+ *
+ * Producers may put() items in any order, and get() returns them strictly by
+ * ascending sequence number, starting from zero. A producer whose item is
+ * capacity or more ahead of the next expected one blocks until the consumer
+ * catches up, which bounds the amount of out-of-order work held here.
+ */
+template<class T>
+struct OrderedQueue {
+	OrderedQueue(size_t capacity) : m_capacity(capacity), m_next(0),
+			m_closed(false) {
+	}
+
+	void put(uint64_t seq, const T& obj) {
+		boost::unique_lock<boost::mutex> lock(m_mutex);
+		while(seq >= m_next + m_capacity && !m_closed) m_notFull.wait(lock);
+		m_entry[seq] = obj;
+		if(seq == m_next) m_ready.notify_one();
+	}
+
+	bool get(T& out) {
+		boost::unique_lock<boost::mutex> lock(m_mutex);
+		while(true) {
+			if(!m_entry.empty() && m_entry.begin()->first == m_next) {
+				out = m_entry.begin()->second;
+				m_entry.erase(m_entry.begin());
+				m_next++;
+				m_notFull.notify_all();
+				return true;
+			}
+			if(m_closed) return false;
+			m_ready.wait(lock);
+		}
+	}
+
+	void close() {
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		m_closed = true;
+		m_ready.notify_all();
+		m_notFull.notify_all();
+	}
+
+private:
+	OrderedQueue(OrderedQueue<T>& q) {
+	}
+
+	size_t m_capacity;
+	uint64_t m_next;
+	bool m_closed;
+	boost::mutex m_mutex;
+	boost::condition_variable m_ready, m_notFull;
+	std::map<uint64_t, T> m_entry;
+};
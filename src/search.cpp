@@ -3,18 +3,24 @@
 #include <vector>
 #include <string>
 #include <stdexcept>
-#include <ctype.h>
+#include <string.h>
+#include <getopt.h>
 
 #include <algorithm>
-#include <map>
 #include <utility>
 #include <unordered_set>
-#include <set>
 #include <list>
 
-#include "rbt.hpp"
 #include "bytes.hpp"
-#include "queue.hpp"
+#include "title.hpp"
+#include "mapfile.hpp"
+#include "mphf.hpp"
+#include "database.hpp"
+#include "format.hpp"
+#include "contentstore.hpp"
+#include "linkscan.hpp"
+#include "adjcache.hpp"
+#include "bfs.hpp"
 
 #include <boost/thread.hpp>
 #include <boost/chrono.hpp>
@@ -24,383 +30,539 @@
 using namespace std;
 using namespace boost;
 
-uint32_t lookupName(FILE* f, string tgtName) {
-	uint32_t addr = 0;
-	char buffer[0x10000];
-	std::less<string> comparer;
-	while(true) {
-		// Read a node header and determine which direction to go in
-		fseek(f, addr, SEEK_SET);
-		uint16_t nameLen = readInt16(f);
-		fread(buffer, nameLen, 1, f);
-		string name = string(buffer, nameLen);
-		uint32_t pl = readInt32(f);
-		uint8_t childInfo;
-		fread(&childInfo, 1, 1, f);
-
-		int dir = 0;
-		if(!comparer(tgtName, name) && !comparer(name, tgtName)) return pl;
-		else if(comparer(name, tgtName)) dir = -1;
-		else dir = 1;
-
-		uint32_t left = 0,
-			right = 0;
-		if((childInfo & 1) > 0) left = readInt32(f);
-		if((childInfo & 2) > 0) right = readInt32(f);
-
-		if(dir == -1) addr = right;
-		else addr = left;
-		if(addr == 0) return 0;
+// Maps redirects to their articles. The base table is already collapsed, but
+// redirects added by an overlay can lead into it and back out again, so the
+// chain is followed for a bounded number of steps.
+class redirect_map {
+	redirect_table base;
+	const delta_overlay& overlay;
+
+public:
+	redirect_map(const delta_overlay& o) : overlay(o) {
 	}
-}
 
-struct LinkDatabase {
-	typedef RBTree<uint32_t, vector<uint32_t>*, delete_cleanup<vector<uint32_t> > > treetype;
-	treetype *cache;
-	vector<uint32_t> empty;
-	FILE* f;
-	uint32_t elements;
-	uint32_t n_cached;
-	shared_mutex lck;
-	mutex diskLock;
-
-	LinkDatabase(FILE* file) : f(file) {
-		cache = new treetype();
-		fseek(f, 0, SEEK_SET);
-		elements = readInt32(f);
-		n_cached = 0;
-	}
-
-	~LinkDatabase() {
-		fclose(f);
-		if(cache != NULL) delete cache;
-	}
-
-	const vector<uint32_t>& retrieve(uint32_t id) {
-		upgrade_lock<shared_mutex> readLock(lck);
-
-		// Check boundaries
-		if(id > elements) return empty;
-
-		// Check cache first
-		if(cache->contains(id)) return *cache->search(id);
-
-		// Check disk backing store
-		vector<uint32_t>* nv = new vector<uint32_t>();
-		{
-			lock_guard<mutex> disklck(diskLock);
-			fseek(f,sizeof(uint32_t)*id,SEEK_SET);
-			uint32_t dataOffset = readInt32(f);
-			fseek(f,dataOffset,SEEK_SET);
-			uint32_t nLinks = readInt32(f);
-			for(uint32_t i=0;i<nLinks;i++) {
-				nv->push_back(readInt32(f));
+	bool open(const char* path) {
+		return base.open(path);
+	}
+
+	uint32_t resolve(uint32_t elem) const {
+		uint32_t x = elem, target;
+		for(int step=0;step<64;step++) {
+			if(overlay.redirect(x, target)) {
+				if(target == 0) return x; // No longer a redirect
+			} else if(!base.lookup(x, target)) {
+				return x;
 			}
+			x = target;
 		}
+		return elem; // Circular
+	}
+};
+
+// Link lists from id_links.bin in either format, with the overlay applied
+class link_file {
+	FILE* f; // Version 1 files are read through this
+	mapped_file mapped; // and version 2 ones in place
+	const uint64_t* index;
+	const uint32_t* targets;
+	uint32_t elements, m_limit;
+	string m_path;
+	boost::mutex diskLock;
+	const delta_overlay& overlay;
+	const redirect_map& redirects;
 
-		upgrade_to_unique_lock<shared_mutex> writeLock(readLock);
-		n_cached += nv->size();
-		cache->insert(id, nv);
-		return *nv;
+public:
+	link_file(const delta_overlay& o, const redirect_map& r) : f(NULL),
+			index(NULL), targets(NULL), elements(0), m_limit(0), overlay(o),
+			redirects(r) {
 	}
 
-	size_t rough_expanded() {
-		return n_cached;
+	~link_file() {
+		if(f != NULL) fclose(f);
 	}
 
-	void try_expand(uint32_t n) {
-		upgrade_lock<shared_mutex> readLock(lck);
+	// Open id_links.bin, or id_inlinks.bin with kind V2_INLINKS, in either
+	// format. Fails if a v2 file is damaged. populate reads the whole of a
+	// v2 file in up front.
+	bool open(const char* path, bool populate, uint32_t kind = V2_LINKS) {
+		m_path = path;
+		if(!mapped.map(path)) return false;
+		const v2_header* h = v2Header(mapped, kind);
+		if(h != NULL) {
+			if(populate && !mapped.map(path, true)) return false;
+			h = v2Header(mapped, kind);
+			elements = h->count;
+			index = v2Section<uint64_t>(mapped, h, 0);
+			targets = v2Section<uint32_t>(mapped, h, 1);
+			if(index[elements + 1] > h->sections[1].size / 4)
+				throw runtime_error("Damaged " + m_path);
+			mapped.adviseRandom();
+		} else {
+			mapped.unmap();
+			f = fopen(path, "rb");
+			if(f == NULL) return false;
+			elements = readInt32(f);
+		}
+		m_limit = elements;
+		if(overlay.present() && overlay.count() > 0)
+			m_limit = max(m_limit, overlay.firstID() + overlay.count() - 1);
+		return true;
+	}
 
-		if(n > elements || cache->contains(n)) return;
+	// Highest page ID
+	uint32_t limit() const {
+		return m_limit;
+	}
 
-		vector<uint32_t>* nv = new vector<uint32_t>();
-		{
-			lock_guard<mutex> disklck(diskLock);
-			fseek(f,sizeof(uint32_t)*n,SEEK_SET);
-			uint32_t dataOffset = readInt32(f);
-			fseek(f,dataOffset,SEEK_SET);
-			uint32_t nLinks = readInt32(f);
-			for(uint32_t i=0;i<nLinks;i++)
-				nv->push_back(readInt32(f));
-		}
+	const string& path() const {
+		return m_path;
+	}
 
-		upgrade_to_unique_lock<shared_mutex> writeLock(readLock);
-		n_cached += nv->size();
-		cache->insert(n, nv);
+	// Links in the base file, for sizing arrays before reading them all. A
+	// version 1 file holds a count and an offset per page besides the links.
+	uint64_t linkCount() const {
+		if(index != NULL) return index[elements + 1];
+		struct stat st;
+		if(fstat(fileno(f), &st) != 0) return 0;
+		uint64_t words = st.st_size / 4;
+		uint64_t overhead = 2*(uint64_t)elements + 1;
+		return words > overhead ? words - overhead : 0;
 	}
-};
 
-void expanderThread(LinkDatabase& db) {
-	uint32_t elems = db.elements;
-	for(uint32_t i=1;i<elems;i++) {
-		db.try_expand(i);
-		this_thread::interruption_point();
+	// Whether the lists in the mapping are the final ones, which is when the
+	// file is version 2 and there is no overlay to change them
+	bool inPlace() const {
+		return index != NULL && !overlay.present();
 	}
-}
 
-string find_name(FILE* f, uint32_t id) {
-	fseek(f,0,SEEK_SET);
-	uint32_t nItems = readInt32(f);
-	if(id > nItems) return "--==<<INVALID ITEM IDENTIFIER>>==--";
-	fseek(f,(sizeof(uint32_t)*id),SEEK_SET);
-	uint32_t nameAddr = (readInt32(f)) + 4 + nItems*sizeof(uint32_t);
-	fseek(f,nameAddr,SEEK_SET);
-	uint16_t nameLen = readInt16(f);
-	char name[nameLen];
-	fread(name, nameLen, 1, f);
-	return string(name, nameLen);
-}
+	const uint64_t* inPlaceIndex() const {
+		return index;
+	}
 
-inline void tolower(char* s) {
-	for(;*s != '\0';s++) *s = tolower(*s);
-}
+	const uint32_t* inPlaceTargets() const {
+		return targets;
+	}
 
-struct nodetuple {
-	uint32_t node, parent;
-	uint32_t distance;
-};
+	// Say how the file is about to be read
+	void adviseSequential() {
+		mapped.adviseSequential();
+	}
 
-void searcher(int n, uint32_t dst, LinkDatabase& dbase, SynchronizedQueue<nodetuple>& input,
-		SynchronizedQueue<nodetuple>& output) {
-	nodetuple t;
-	while(true) {
-		try {
-			t = input.get(0.1);
-		} catch(runtime_error& e) {
-			return;
+	void adviseRandom() {
+		mapped.adviseRandom();
+	}
+
+	// Read a page's links, from the overlay if it has them. Base lists only
+	// know about the base redirects, so with an overlay they are resolved
+	// again through its redirects.
+	void fetch(uint32_t id, vector<uint32_t>& out) {
+		out.clear();
+		if(!overlay.links(id, out) && id <= elements) {
+			if(index != NULL) {
+				// The list is already an array of IDs in the mapping
+				uint64_t begin = index[id], end = index[id+1];
+				if(begin <= end && end <= index[elements + 1])
+					out.assign(targets + begin, targets + end);
+			} else {
+				boost::lock_guard<boost::mutex> disklck(diskLock);
+				fseek(f,sizeof(uint32_t)*id,SEEK_SET);
+				uint32_t dataOffset = readInt32(f);
+				fseek(f,dataOffset,SEEK_SET);
+				out.resize(readInt32(f));
+				out.resize(readInt32Array(f, out.data(), out.size()));
+			}
 		}
-		const vector<uint32_t>& vec = dbase.retrieve(t.node);
-		for(vector<uint32_t>::const_iterator i=vec.begin();i != vec.end();i++) {
-			output.put({*i, t.node, t.distance+1});
-			if(*i == dst) return;
+		if(overlay.hasRedirects()) {
+			for(size_t i=0;i<out.size();i++) out[i] = redirects.resolve(out[i]);
+			sort(out.begin(), out.end());
+			out.erase(unique(out.begin(), out.end()), out.end());
 		}
-		boost::this_thread::interruption_point();
 	}
-}
+};
 
-class redirect_map {
-	FILE* mapfile;
-	size_t entries;
+// A page's links, valid for as long as the graph they came from
+struct link_view {
+	const uint32_t* data;
+	uint32_t size;
 
-public:
-	redirect_map(FILE* f) : mapfile(f) {
-		fseek(mapfile, 0, SEEK_END);
-		long n = ftell(mapfile);
-		entries = n / 8;
-	}
-
-	uint32_t resolve(uint32_t elem) {
-		uint32_t r = search_impl(elem, entries-1, 0);
-		return (r == 0) ? elem : r;
-	}
-
-private:
-	uint32_t search_impl(uint32_t elem, uint32_t upper, uint32_t lower) {
-		// Use a simple binary search
-		if(lower > upper) return 0;
-		uint32_t searchIdx = lower + ((upper - lower) / 2);
-		if(upper == lower) searchIdx = lower;
-		
-		// Read that entry
-		fseek(mapfile, 8*searchIdx, SEEK_SET);
-		uint32_t src = readInt32(mapfile);
-
-		// I love tail-call optimization
-		if(src == elem) {
-			return readInt32(mapfile);
-		} else if(src < elem) {
-			return search_impl(elem, upper, searchIdx+1);
-		} else if(src > elem) {
-			return search_impl(elem, searchIdx-1, lower);
-		}
-		return 0;
+	link_view() : data(NULL), size(0) {
+	}
+
+	link_view(const uint32_t* d, uint32_t n) : data(d), size(n) {
+	}
+
+	const uint32_t* begin() const {
+		return data;
+	}
+
+	const uint32_t* end() const {
+		return data + size;
 	}
 };
 
-list<uint32_t> pathfind(uint32_t src, uint32_t dst, LinkDatabase& dbase) {
-	// Breadth-first search
-	map<uint32_t, pair<uint32_t, uint32_t> > parents;
-	set<uint32_t> nextRound;
-	SynchronizedQueue<nodetuple> input, output;
-	thread* workers[THREADS];
-	int depth = 1;
-
-	// Prepopulate the input queue
-	{
-		const vector<uint32_t>& vec = dbase.retrieve(src);
-		for(vector<uint32_t>::const_iterator i=vec.begin();i != vec.end();i++) {
-			input.put({*i, src, 1});
-			parents[*i] = make_pair(src, 1);
+/* The whole graph as compressed sparse rows: page P's links are
+ * targets[index[P]] up to targets[index[P+1]]. A version 2 file with no
+ * overlay already has this layout and is used where it is mapped; anything
+ * else is read into arrays of our own once. Either way links() is a couple of
+ * loads, with no locking, allocation or system calls. */
+class csr_graph {
+	const uint64_t* m_index;
+	const uint32_t* m_targets;
+	uint32_t m_count;
+	vector<uint64_t> m_ownIndex;
+	vector<uint32_t> m_ownTargets;
+
+public:
+	csr_graph() : m_index(NULL), m_targets(NULL), m_count(0) {
+	}
+
+	// Fails if the index of a mapped file is out of order
+	void build(link_file& file) {
+		m_count = file.limit();
+		if(file.inPlace()) {
+			// Check the index once, so links() can trust it
+			const uint64_t* index = file.inPlaceIndex();
+			file.adviseSequential();
+			for(uint32_t i=1;i<=m_count;i++)
+				if(index[i] > index[i+1])
+					throw runtime_error("Damaged " + file.path());
+			file.adviseRandom();
+			m_index = index;
+			m_targets = file.inPlaceTargets();
+			return;
+		}
+
+		file.adviseSequential();
+		m_ownIndex.reserve((size_t)m_count + 2);
+		m_ownIndex.assign(2, 0);
+		m_ownTargets.reserve(file.linkCount());
+		vector<uint32_t> list;
+		for(uint32_t i=1;i<=m_count;i++) {
+			file.fetch(i, list);
+			m_ownTargets.insert(m_ownTargets.end(), list.begin(), list.end());
+			m_ownIndex.push_back(m_ownTargets.size());
 		}
+		file.adviseRandom();
+		m_index = m_ownIndex.data();
+		m_targets = m_ownTargets.data();
 	}
 
-	list<thread*> running;
-	bool found_result = false;
-	list<uint32_t> path;
-	while(!found_result) {
-		// Spark threads
-		running.clear();
-		for(int i=0;i<THREADS;i++) {
-			workers[i] = new thread(searcher, i, dst, boost::ref(dbase),
-					boost::ref(input), boost::ref(output));
-			running.push_back(workers[i]);
+	// Make this g with every link reversed, for when there's no
+	// id_inlinks.bin that matches it. The sources are bucketed by target
+	// after counting them, so every list comes out sorted.
+	void transpose(const csr_graph& g) {
+		m_count = g.limit();
+		m_ownIndex.assign((size_t)m_count + 2, 0);
+		for(uint32_t i=1;i<=m_count;i++) {
+			link_view l = g.links(i);
+			for(const uint32_t* t=l.begin();t != l.end();t++)
+				if(*t != 0 && *t <= m_count) m_ownIndex[*t + 1]++;
+		}
+		for(uint32_t i=1;i<=m_count;i++) m_ownIndex[i+1] += m_ownIndex[i];
+		m_ownTargets.resize(m_ownIndex[m_count + 1]);
+		vector<uint64_t> pos(m_ownIndex.begin(), m_ownIndex.end() - 1);
+		for(uint32_t i=1;i<=m_count;i++) {
+			link_view l = g.links(i);
+			for(const uint32_t* t=l.begin();t != l.end();t++)
+				if(*t != 0 && *t <= m_count) m_ownTargets[pos[*t]++] = i;
 		}
+		m_index = m_ownIndex.data();
+		m_targets = m_ownTargets.data();
+	}
 
-		// Wait for threads to finish
-		while(true) {
-			// Print queue status
-			printf("\rI=%18d P=%18d C=%18d A=%2d D=%3d", input.approxSize(),
-					output.approxSize(), nextRound.size(),
-					running.size(), depth);
-			fflush(stdout);
-
-			// Check if all threads are gone
-			if(running.empty()) break;
-
-			for(list<thread*>::iterator i=running.begin();i != running.end();) {
-				if((*i)->try_join_for(chrono::milliseconds(200))) {
-					list<thread*>::iterator itr = i;
-					i++;
-					running.erase(itr);
-					for(int j=0;j<THREADS && workers[j] != (*i);j++);
-					break;
-				} else i++;
-			}
+	typedef link_view list_type;
 
-			// Process the output list
-			nodetuple t;
-			map<uint32_t, pair<uint32_t, uint32_t> >::iterator itr;
-			for(int i=0;i<8192;i++) {
-				try {
-					t = output.get(0.5);
-				} catch(runtime_error& e) {
-					break;
-				}
-
-				// Store parent and queue for next round
-				itr = parents.find(t.node);
-				if(itr == parents.end() || t.distance < itr->second.second) {
-					parents[t.node] = make_pair(t.parent, t.distance);
-					nextRound.insert(t.node);
-				} else if(itr == parents.end())
-					nextRound.insert(t.node);
-			}
+	uint32_t limit() const {
+		return m_count;
+	}
 
-			// Check whether the result has completed
-			if(parents.find(dst) != parents.end()) {
-				found_result = true;
-				break;
-			}
-		}
-		if(found_result) break;
-		putchar('\n');
+	// Everything is in memory already
+	void prefetch(const vector<uint32_t>&) {
+	}
 
-		// Delete threads
-		for(int i=0;i<THREADS;i++) delete workers[i];
-
-		// Make sure all output is processed
-		nodetuple t;
-		map<uint32_t, pair<uint32_t, uint32_t> >::iterator itr;
-		while(true) {
-			try {
-				t = output.get(0.5);
-			} catch(runtime_error& e) {
-				break;
-			}
+	link_view links(uint32_t id) const {
+		if(id == 0 || id > m_count) return link_view();
+		uint64_t begin = m_index[id];
+		return link_view(m_targets + begin, m_index[id+1] - begin);
+	}
+};
 
-			// Store parent and queue for next round
-			itr = parents.find(t.node);
-			if(itr == parents.end() || t.distance < itr->second.second) {
-				parents[t.node] = make_pair(t.parent, t.distance);
-				nextRound.insert(t.node);
-			} else if(itr == parents.end())
-				nextRound.insert(t.node);
-			if(output.approxSize() % 1000000 == 0) {
-				printf("\rPostprocessing (%8d remain)", output.approxSize());
-				fflush(stdout);
-			}
-		}
+string find_name(const name_table& names, const delta_overlay& overlay,
+		uint32_t id) {
+	string name;
+	if(overlay.name(id, name) || names.name(id, name)) return name;
+	return "--==<<INVALID ITEM IDENTIFIER>>==--";
+}
 
-		// Collate results
-		for(set<uint32_t>::iterator i=nextRound.begin();i != nextRound.end();i++) {
-			input.put({*i, parents[*i].first, parents[*i].second});
-		}
-		depth++;
-		nextRound.clear();
-		putchar('\n');
+// Look up a normalized title through the perfect hash. The fingerprint lets
+// through a tiny fraction of unknown titles, so the page's name is checked
+// before trusting the ID.
+uint32_t lookupHashed(const mph_index& index, const name_table& names,
+		const delta_overlay& overlay, const string& key) {
+	uint32_t id = index.lookup(titleHash(key.data(), key.length()));
+	if(id == 0) return 0;
+	string name = find_name(names, overlay, id), found;
+	normalizeTitle(name.data(), name.length(), found);
+	return (found == key) ? id : 0;
+}
+
+// Finds pages by normalized title: in the overlay first, then through the
+// perfect hash if there is one, and the trie otherwise
+struct title_lookup {
+	const mph_index* hashes;
+	const mapped_file* ids;
+	const name_table* names;
+	const delta_overlay* overlay;
+
+	uint32_t operator()(const string& key) const {
+		uint32_t id = overlay->lookupName(key);
+		if(id != 0) return id;
+		if(hashes != NULL) return lookupHashed(*hashes, *names, *overlay, key);
+		return lookupName(*ids, key);
 	}
-	putchar('\n');
-	
-	for(int i=0;i<THREADS;i++) {
-		workers[i]->interrupt();
-		workers[i]->join();
-		delete workers[i];
-	}
-	
-	if(found_result) {
-		// Reconstruct path and print it
-		uint32_t elem;
-		for(elem=dst;elem != src;) {
-			path.push_front(elem);
-			elem = parents[elem].first;
-		}
-		path.push_front(src);
-		return path;
+};
+
+// Print the text around the link from one page of a path to the next. The
+// link can name a redirect to the page rather than the page itself.
+void printContext(content_store& contents, const title_lookup& lookup,
+		redirect_map& redirects, uint32_t from, uint32_t to) {
+	string text, key;
+	if(!contents.text(from, text)) return;
+	vector<link_span> links;
+	scanLinks(text.data(), text.length(), links);
+	for(size_t i=0;i<links.size();i++) {
+		const link_span& l = links[i];
+		normalizeTitle(text.data() + l.offset, l.length, key);
+		uint32_t id = lookup(key);
+		if(id == 0 || redirects.resolve(id) != to) continue;
+
+		size_t start = l.offset > 60 ? l.offset - 60 : 0;
+		size_t end = min<size_t>(text.length(), l.offset + l.length + 60);
+		string around = text.substr(start, end - start);
+		replace(around.begin(), around.end(), '\n', ' ');
+		replace(around.begin(), around.end(), '\t', ' ');
+		printf("\t...%s...\n", around.c_str());
+		return;
 	}
-	return path;
+}
+
+// Graph is csr_graph or adjacency_cache. reverse, if there is one, lets the
+// search go bottom up or from both ends; see parallel_bfs for alpha and beta.
+template<typename Graph>
+list<uint32_t> pathfind(uint32_t src, uint32_t dst, Graph& dbase,
+		Graph* reverse, bool bidirectional, unsigned alpha, unsigned beta) {
+	unsigned threads = min<unsigned>(THREADS,
+			max(1u, thread::hardware_concurrency()));
+	parallel_bfs<Graph> bfs(dbase, threads, reverse, alpha, beta);
+	vector<uint32_t> found;
+	boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+	bool ok = bidirectional ? bfs.searchBidirectional(src, dst, found) :
+		bfs.search(src, dst, found);
+	boost::chrono::duration<double, boost::milli> took =
+		boost::chrono::steady_clock::now() - start;
+
+	const typename parallel_bfs<Graph>::statistics& st = bfs.stats();
+	printf("Searched %u levels (%u bottom up), %llu pages and %llu links "
+			"in %.1f ms\n", st.levels, st.bottomUpLevels,
+			(unsigned long long)st.visited, (unsigned long long)st.edges,
+			took.count());
+	if(!ok) printf("No path found\n");
+	return list<uint32_t>(found.begin(), found.end());
+}
+
+void printCacheStats(const char* name, adjacency_cache<link_file>& cache) {
+	adjacency_cache<link_file>::statistics st = cache.stats();
+	printf("%s: %llu hits, %llu misses, %llu prefetched, %llu evicted, "
+			"%zu lists in %.1f MB\n", name, (unsigned long long)st.hits,
+			(unsigned long long)st.misses, (unsigned long long)st.prefetched,
+			(unsigned long long)st.evictions, st.entries, st.bytes / 1048576.0);
 }
 
 // Run a breadth-first search of the tree for a path between the two nodes
 // named on the command line.
+static const struct option longOptions[] = {
+	{"context", no_argument, NULL, 'c'},
+	{"backend", required_argument, NULL, 'b'},
+	{"populate", no_argument, NULL, 'p'},
+	{"cache-size", required_argument, NULL, 'm'},
+	{"bidirectional", no_argument, NULL, 'd'},
+	{"top-down", no_argument, NULL, 't'},
+	{"alpha", required_argument, NULL, 'a'},
+	{"beta", required_argument, NULL, 'B'},
+	{NULL, 0, NULL, 0}
+};
+
+void usage(const char* name) {
+	fprintf(stderr, "Usage: %s [--context] [--backend=csr|cache] [--populate] "
+			"[--cache-size=MB] [--bidirectional] [--top-down] [--alpha=N] "
+			"[--beta=N] [source] [dest]\n"
+			"The CSR backend is used when id_links.bin can be searched in "
+			"place, which\nneeds a version 2 database and no overlay. "
+			"Otherwise lists are read as they\nare needed unless "
+			"--backend=csr asks for them all to be read into memory.\n",
+			name);
+	exit(1);
+}
+
+enum backend_kind {BACKEND_AUTO, BACKEND_CSR, BACKEND_CACHE};
+
 int main(int argc, char **argv) {
-	if(argc != 3) {
-		fprintf(stderr, "Usage: %s [source] [dest]\n", argv[0]);
+	bool showContext = false, useCache = false, populate = false;
+	backend_kind backend = BACKEND_AUTO;
+	bool bidirectional = false, topDown = false;
+	size_t cacheSize = 512; // MB
+	unsigned alpha = 4, beta = 24;
+	int opt;
+	while((opt = getopt_long(argc, argv, "cb:pm:d", longOptions, NULL)) != -1) {
+		if(opt == 'c') showContext = true;
+		else if(opt == 'b' && strcmp(optarg, "csr") == 0) backend = BACKEND_CSR;
+		else if(opt == 'b' && strcmp(optarg, "cache") == 0)
+			backend = BACKEND_CACHE;
+		else if(opt == 'p') populate = true;
+		else if(opt == 'm' && atoi(optarg) > 0) cacheSize = atoi(optarg);
+		else if(opt == 'd') bidirectional = true;
+		else if(opt == 't') topDown = true;
+		else if(opt == 'a' && atoi(optarg) > 0) alpha = atoi(optarg);
+		else if(opt == 'B' && atoi(optarg) > 0) beta = atoi(optarg);
+		else usage(argv[0]);
+	}
+	if(optind != argc - 2) usage(argv[0]);
+	if(topDown) alpha = 0;
+	const char* srcName = argv[optind];
+	const char* dstName = argv[optind+1];
+
+	// Titles are looked up through the perfect hash if preprocess built one,
+	// and through the trie otherwise
+	mapped_file ids, mph;
+	mph_index titleHashes;
+	bool haveMph = mph.map("name_mph.bin");
+	if(haveMph && !titleHashes.open(mph)) {
+		fprintf(stderr, "Ignoring malformed name_mph.bin\n");
+		haveMph = false;
+	}
+	bool haveIds = haveMph || ids.map("name_id.bin");
+
+	// Try opening the databases. The tables can be in either format, and
+	// the links are only opened once the overlay is known, as it adds pages.
+	name_table names;
+	delta_overlay overlay;
+	redirect_map redirects(overlay);
+	link_file links(overlay, redirects);
+	bool opened;
+	try {
+		opened = haveIds && names.open("id_name.bin") &&
+			redirects.open("redirects.bin");
+
+		// Pick up the changes made by preprocess --incremental, if any
+		if(opened && overlay.load())
+			printf("Using overlay with %u added pages\n", overlay.count());
+		opened = opened && links.open("id_links.bin", populate);
+	} catch(runtime_error& e) {
+		fprintf(stderr, "%s\n", e.what());
 		return 1;
 	}
-
-	// Try opening the databases
-	FILE* f_names = fopen("id_name.bin", "rb");
-	FILE* f_links = fopen("id_links.bin", "rb");
-	FILE* f_ids = fopen("name_id.bin", "rb");
-	FILE* f_redirects = fopen("redirects.bin", "rb");
-	if((f_names == NULL) ||
-			(f_links == NULL) ||
-			(f_ids == NULL) ||
-			(f_redirects == NULL)) {
+	if(!opened) {
 		fprintf(stderr, "Cannot open one or more database files\n");
-		if(f_names != NULL)	fclose(f_names);
-		if(f_links != NULL)	fclose(f_links);
-		if(f_ids != NULL)	fclose(f_ids);
-		if(f_redirects != NULL)	fclose(f_redirects);
 		return 1;
 	}
 
-	// Start loading the links database
-	LinkDatabase dbase(f_links);
-	thread expander(expanderThread, boost::ref(dbase));
+	// The CSR backend costs nothing up front when the file already has its
+	// layout. Anything else would have to be read into memory whole, so unless
+	// that was asked for, lists are read as they are needed instead.
+	useCache = backend == BACKEND_CACHE ||
+		(backend == BACKEND_AUTO && !links.inPlace());
+	if(backend == BACKEND_AUTO && useCache) {
+		if(overlay.present())
+			printf("Reading links as needed, as the overlay changes them; "
+					"pass --backend=csr to read them all first\n");
+		else
+			printf("Reading links as needed, as id_links.bin is version 1; "
+					"run convertdb to search it in place\n");
+	}
+
+	// Searching bottom up or from both ends needs the links reversed.
+	// id_inlinks.bin has them, unless an overlay has changed the links since
+	// or the database is older than it. The cache backend can only search
+	// forward then. The CSR one can reverse the graph itself, but that holds
+	// a second copy of it in memory, so it only does so to search from both
+	// ends and otherwise stays top down.
+	bool wantReverse = bidirectional || (!useCache && alpha > 0);
+	delta_overlay noOverlay;
+	redirect_map noRedirects(noOverlay);
+	link_file inlinks(noOverlay, noRedirects);
+	bool haveInlinks = false;
+	try {
+		haveInlinks = wantReverse && !overlay.present() &&
+			inlinks.open("id_inlinks.bin", populate, V2_INLINKS) &&
+			inlinks.limit() == links.limit();
+	} catch(runtime_error& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+	if(!useCache && !haveInlinks && !bidirectional && alpha > 0) {
+		printf("Searching top down, as there is no id_inlinks.bin that "
+				"matches the links\n");
+		alpha = 0;
+		wantReverse = false;
+	}
 
-	// Load the redirect mapping into memory
-	redirect_map redirects(f_redirects);
+	// The cache backend reads lists as they are needed and keeps what fits in
+	// its budget, which the two directions share. The CSR one has them all in
+	// place before searching.
+	adjacency_cache<link_file>* cache = NULL;
+	adjacency_cache<link_file>* reverseCache = NULL;
+	csr_graph graph, reverse;
+	if(useCache) {
+		size_t budget = cacheSize << 20;
+		if(bidirectional && haveInlinks) {
+			budget /= 2;
+			reverseCache = new adjacency_cache<link_file>(inlinks, budget);
+		} else if(bidirectional) {
+			printf("Searching forward only, as there is no id_inlinks.bin "
+					"that matches the links\n");
+		}
+		cache = new adjacency_cache<link_file>(links, budget);
+	} else {
+		try {
+			graph.build(links);
+			if(haveInlinks) reverse.build(inlinks);
+			else if(wantReverse) reverse.transpose(graph);
+		} catch(runtime_error& e) {
+			fprintf(stderr, "%s\n", e.what());
+			return 1;
+		}
+	}
 
 	// Load the name trie and dereference the names
-	uint32_t src, dst;
-	tolower(argv[1]); tolower(argv[2]);
-	src = lookupName(f_ids, argv[1]);
-	dst = lookupName(f_ids, argv[2]);
-	fclose(f_ids);
+	title_lookup lookup = {haveMph ? &titleHashes : NULL, &ids, &names,
+		&overlay};
+	if(!haveMph) ids.adviseRandom();
+	string srcKey, dstKey;
+	normalizeTitle(srcName, strlen(srcName), srcKey);
+	normalizeTitle(dstName, strlen(dstName), dstKey);
+	uint32_t src = lookup(srcKey), dst = lookup(dstKey);
+
+	// The titles are needed again to find the links in the text
+	content_store contents;
+	try {
+		showContext = showContext && contents.open("contents.bin");
+	} catch(runtime_error& e) {
+		fprintf(stderr, "%s\n", e.what());
+		showContext = false;
+	}
+	if(!showContext) {
+		ids.unmap();
+		mph.unmap();
+	}
 	if(src == 0) {
-		fprintf(stderr, "Unable to find node: %s\n", argv[1]);
-		expander.interrupt();
-		expander.join();
-
-		fclose(f_names);
+		fprintf(stderr, "Unable to find node: %s\n", srcName);
+		delete cache;
+		delete reverseCache;
 		return 1;
 	} else if(dst == 0) {
-		fprintf(stderr, "Unable to find node: %s\n", argv[2]);
-		expander.interrupt();
-		expander.join();
-	
-		fclose(f_names);
+		fprintf(stderr, "Unable to find node: %s\n", dstName);
+		delete cache;
+		delete reverseCache;
 		return 1;
 	}
 
@@ -411,24 +573,36 @@ int main(int argc, char **argv) {
 	dst = redirects.resolve(dst);
 
 	printf("src=%8d\tdst=%8d\n", src, dst);
-	printf("That is, %s -> %s\n", find_name(f_names, src).c_str(),
-			find_name(f_names, dst).c_str());
+	printf("That is, %s -> %s\n", find_name(names, overlay, src).c_str(),
+			find_name(names, overlay, dst).c_str());
 
-	list<uint32_t> path = pathfind(src, dst, dbase);
+	list<uint32_t> path = useCache ?
+		pathfind(src, dst, *cache, reverseCache, bidirectional, 0, beta) :
+		pathfind(src, dst, graph, wantReverse ? &reverse : NULL, bidirectional,
+				alpha, beta);
 	if(!path.empty()) {
-		printf("%s -> ", find_name(f_names, src).c_str());
+		printf("%s -> ", find_name(names, overlay, src).c_str());
 		for(list<uint32_t>::iterator i=++path.begin();i != path.end();i++) {
-			printf("%s", find_name(f_names, *i).c_str());
+			printf("%s", find_name(names, overlay, *i).c_str());
 			if(*i != dst) printf(" -> ");
 		}
 		putchar('\n');
-	}
 
-	// Terminate database expander thread
-	expander.interrupt();
-	expander.join();
+		if(showContext) {
+			uint32_t from = src;
+			for(list<uint32_t>::iterator i=++path.begin();i != path.end();i++) {
+				printf("%s -> %s\n", find_name(names, overlay, from).c_str(),
+						find_name(names, overlay, *i).c_str());
+				printContext(contents, lookup, redirects, from, *i);
+				from = *i;
+			}
+		}
+	}
 
-	fclose(f_names);
+	if(cache != NULL) printCacheStats("Cache", *cache);
+	if(reverseCache != NULL) printCacheStats("Reverse cache", *reverseCache);
+	delete cache;
+	delete reverseCache;
 	return 0;
 
 }
@@ -1,111 +1,439 @@
 #include "strtree.hpp"
 
-#include <map>
 #include <list>
+#include <vector>
 #include <utility>
 #include <algorithm>
 #include <string.h>
 #include "bytes.hpp"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 using namespace std;
 
-strtree_node::strtree_node() {
-	memset(children, 0, sizeof(strtree_node*)*0x100);
-	is_leaf = false;
+static strtree_node* newNode(uint8_t kind) {
+	strtree_node* n;
+	switch(kind) {
+		case STRTREE_NODE4: n = new strtree_node4(); break;
+		case STRTREE_NODE16: n = new strtree_node16(); break;
+		case STRTREE_NODE48: n = new strtree_node48(); break;
+		default: n = new strtree_node256(); break;
+	}
+	n->kind = kind;
+	return n;
 }
 
-strtree_node::~strtree_node() {
-	for(int i=0;i<256;i++) {
-		if(children[i] != NULL)
-			delete children[i];
+// Delete a node without touching its prefix or children, which have been
+// handed on to a node of another kind
+static void deleteShell(strtree_node* n) {
+	switch(n->kind) {
+		case STRTREE_NODE4: delete (strtree_node4*)n; break;
+		case STRTREE_NODE16: delete (strtree_node16*)n; break;
+		case STRTREE_NODE48: delete (strtree_node48*)n; break;
+		default: delete (strtree_node256*)n; break;
 	}
 }
 
-strtree::strtree() {
-	root = new strtree_node();
+static void setPrefix(strtree_node* n, const uint8_t* data, size_t len) {
+	// The new prefix is often part of the old one, so copy it out first
+	uint8_t* heap = NULL;
+	if(len > sizeof(n->prefix.inline_)) {
+		heap = new uint8_t[len];
+		memcpy(heap, data, len);
+	} else {
+		uint8_t tmp[sizeof(n->prefix.inline_)];
+		memcpy(tmp, data, len);
+		data = tmp;
+		if(n->prefixLen > sizeof(n->prefix.inline_)) delete[] n->prefix.heap;
+		memcpy(n->prefix.inline_, data, len);
+		n->prefixLen = len;
+		return;
+	}
+	if(n->prefixLen > sizeof(n->prefix.inline_)) delete[] n->prefix.heap;
+	n->prefix.heap = heap;
+	n->prefixLen = len;
 }
 
-strtree::strtree(FILE* f) {
+// Call f on each child in key order
+template<typename F>
+static void eachChild(strtree_node* n, F f) {
+	switch(n->kind) {
+		case STRTREE_NODE4: {
+			strtree_node4* n4 = (strtree_node4*)n;
+			for(int i=0;i<n->count;i++) f(n4->keys[i], n4->children[i]);
+			break;
+		}
+		case STRTREE_NODE16: {
+			strtree_node16* n16 = (strtree_node16*)n;
+			for(int i=0;i<n->count;i++) f(n16->keys[i], n16->children[i]);
+			break;
+		}
+		case STRTREE_NODE48: {
+			strtree_node48* n48 = (strtree_node48*)n;
+			for(int b=0;b<256;b++)
+				if(n48->index[b] != 0) f(b, n48->children[n48->index[b] - 1]);
+			break;
+		}
+		default: {
+			strtree_node256* n256 = (strtree_node256*)n;
+			for(int b=0;b<256;b++)
+				if(n256->children[b] != NULL) f(b, n256->children[b]);
+			break;
+		}
+	}
+}
+
+struct node_deleter {
+	void operator()(int, strtree_node* child) const;
+};
+
+static void freeNode(strtree_node* n) {
+	eachChild(n, node_deleter());
+	if(n->prefixLen > sizeof(n->prefix.inline_)) delete[] n->prefix.heap;
+	deleteShell(n);
+}
+
+void node_deleter::operator()(int, strtree_node* child) const {
+	freeNode(child);
+}
+
+static strtree_node** findChild(strtree_node* n, uint8_t key) {
+	switch(n->kind) {
+		case STRTREE_NODE4: {
+			strtree_node4* n4 = (strtree_node4*)n;
+			for(int i=0;i<n->count;i++)
+				if(n4->keys[i] == key) return &n4->children[i];
+			return NULL;
+		}
+		case STRTREE_NODE16: {
+			strtree_node16* n16 = (strtree_node16*)n;
+#ifdef __SSE2__
+			__m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(key),
+					_mm_loadu_si128((const __m128i*)n16->keys));
+			unsigned mask = _mm_movemask_epi8(cmp) & ((1u << n->count) - 1);
+			if(mask == 0) return NULL;
+			return &n16->children[__builtin_ctz(mask)];
+#else
+			for(int i=0;i<n->count;i++)
+				if(n16->keys[i] == key) return &n16->children[i];
+			return NULL;
+#endif
+		}
+		case STRTREE_NODE48: {
+			strtree_node48* n48 = (strtree_node48*)n;
+			if(n48->index[key] == 0) return NULL;
+			return &n48->children[n48->index[key] - 1];
+		}
+		default: {
+			strtree_node256* n256 = (strtree_node256*)n;
+			if(n256->children[key] == NULL) return NULL;
+			return &n256->children[key];
+		}
+	}
+}
+
+// Insert into sorted keys/children arrays with room for one more
+template<typename N>
+static void insertSorted(N* n, uint8_t key, strtree_node* child) {
+	int i = n->count;
+	while(i > 0 && n->keys[i-1] > key) {
+		n->keys[i] = n->keys[i-1];
+		n->children[i] = n->children[i-1];
+		i--;
+	}
+	n->keys[i] = key;
+	n->children[i] = child;
+	n->count++;
+}
+
+// Move a node into the next bigger kind, replacing it where ref points
+static strtree_node* grow(strtree_node** ref) {
+	strtree_node* n = *ref;
+	strtree_node* bigger = newNode(n->kind + 1);
+	uint8_t kind = bigger->kind;
+	*bigger = *n; // Header and prefix
+	bigger->kind = kind;
+	switch(n->kind) {
+		case STRTREE_NODE4: {
+			strtree_node4* from = (strtree_node4*)n;
+			strtree_node16* to = (strtree_node16*)bigger;
+			memcpy(to->keys, from->keys, n->count);
+			memcpy(to->children, from->children, n->count * sizeof(strtree_node*));
+			break;
+		}
+		case STRTREE_NODE16: {
+			strtree_node16* from = (strtree_node16*)n;
+			strtree_node48* to = (strtree_node48*)bigger;
+			for(int i=0;i<n->count;i++) {
+				to->index[from->keys[i]] = i + 1;
+				to->children[i] = from->children[i];
+			}
+			break;
+		}
+		default: {
+			strtree_node48* from = (strtree_node48*)n;
+			strtree_node256* to = (strtree_node256*)bigger;
+			for(int b=0;b<256;b++)
+				if(from->index[b] != 0)
+					to->children[b] = from->children[from->index[b] - 1];
+			break;
+		}
+	}
+	deleteShell(n);
+	*ref = bigger;
+	return bigger;
+}
+
+static void addChild(strtree_node** ref, uint8_t key, strtree_node* child) {
+	strtree_node* n = *ref;
+	switch(n->kind) {
+		case STRTREE_NODE4:
+			if(n->count < 4) return insertSorted((strtree_node4*)n, key, child);
+			break;
+		case STRTREE_NODE16:
+			if(n->count < 16) return insertSorted((strtree_node16*)n, key, child);
+			break;
+		case STRTREE_NODE48:
+			if(n->count < 48) {
+				strtree_node48* n48 = (strtree_node48*)n;
+				n48->children[n->count] = child;
+				n48->index[key] = ++n->count;
+				return;
+			}
+			break;
+		default:
+			((strtree_node256*)n)->children[key] = child;
+			n->count++;
+			return;
+	}
+	// Full, so move to the next kind up, which has room
+	grow(ref);
+	addChild(ref, key, child);
+}
+
+strtree::strtree() {
+	root = newNode(STRTREE_NODE4);
 }
 
 strtree::~strtree() {
-	delete root;
+	freeNode(root);
 }
 
-bool strtree::has(ustring s) {
+const strtree_node* strtree::find(const ustring& s) const {
 	strtree_node* node = root;
-	for(ustring::iterator i=s.begin();node != NULL && i != s.end();i++)
-		node = node->children[*i];
+	size_t depth = 0;
+	while(true) {
+		if(node->prefixLen > s.length() - depth ||
+				memcmp(node->prefixData(), s.data() + depth, node->prefixLen) != 0)
+			return NULL;
+		depth += node->prefixLen;
+		if(depth == s.length()) return node;
+		strtree_node** child = findChild(node, s[depth]);
+		if(child == NULL) return NULL;
+		node = *child;
+		depth++;
+	}
+}
+
+bool strtree::has(ustring s) {
+	const strtree_node* node = find(s);
 	return (node != NULL) && node->is_leaf;
 }
 
 void strtree::set(ustring s, uint32_t v) {
-	strtree_node* node = root;
+	strtree_node** ref = &root;
+	size_t depth = 0;
+	while(true) {
+		strtree_node* node = *ref;
+		const uint8_t* prefix = node->prefixData();
+		size_t p = 0, most = min<size_t>(node->prefixLen, s.length() - depth);
+		while(p < most && prefix[p] == s[depth + p]) p++;
+		if(p < node->prefixLen) {
+			// The key leaves the prefix part way along, so split it there.
+			// The byte where they differ becomes the edge to the old node.
+			strtree_node* split = newNode(STRTREE_NODE4);
+			setPrefix(split, prefix, p);
+			uint8_t edge = prefix[p];
+			setPrefix(node, prefix + p + 1, node->prefixLen - p - 1);
+			addChild(&split, edge, node);
+			*ref = node = split;
+		}
+		depth += p;
 
-	for(ustring::iterator i=s.begin();i != s.end();i++) {
-		if(node->children[*i] == NULL) {
-			node->children[*i] = new strtree_node();
+		if(depth == s.length()) {
+			node->is_leaf = true;
+			node->value = v;
+			return;
+		}
+		strtree_node** child = findChild(node, s[depth]);
+		if(child == NULL) {
+			// The rest of the key goes into the new leaf's prefix
+			strtree_node* leaf = newNode(STRTREE_NODE4);
+			setPrefix(leaf, s.data() + depth + 1, s.length() - depth - 1);
+			leaf->is_leaf = true;
+			leaf->value = v;
+			addChild(ref, s[depth], leaf);
+			return;
 		}
-		node = node->children[*i];
+		ref = child;
+		depth++;
 	}
-	node->is_leaf = true;
-	node->value = v;
 }
 
 uint32_t strtree::get(ustring s) {
-	strtree_node* node = root;
-	ustring::iterator i = s.begin();
-	for(ustring::iterator i=s.begin();node != NULL && i != s.end();i++)
-		node = node->children[*i];
+	const strtree_node* node = find(s);
 	if(node == NULL || !node->is_leaf) return 0;
 	return node->value;
 }
 
-void strtree::serialize(FILE* outFile) {
+/* Each node is written as its kind in the low bits of a byte whose top bit
+ * says whether it has a value, the value if so as a uint32, the prefix length
+ * as a uint32 and the prefix. Then come its children: for the 4 and 16 kinds
+ * the count as a byte, the keys and a uint32 offset for each; for 48 the
+ * count, the 256-byte index and the offsets; for 256 an offset for every byte,
+ * 0 where there is no child. Offsets are absolute file positions, and each
+ * node comes before its children. */
+struct child_queue {
+	BinaryWriter* out;
+	list<pair<uint64_t, strtree_node*> >* relocations;
+	list<strtree_node*>* queue;
+
+	void operator()(int, strtree_node* child) const {
+		relocations->push_back(make_pair(out->tell(), child));
+		queue->push_back(child);
+		out->writeInt32(0); // write placeholder
+	}
+};
+
+struct key_collector {
+	vector<uint8_t>* keys;
+
+	void operator()(int key, strtree_node*) const {
+		keys->push_back(key);
+	}
+};
+
+void strtree::serialize(BinaryWriter& out) {
 	// Address tables
-	list<pair<uint32_t, strtree_node*> > relocations; // (loc, nodeptr)
-	map<strtree_node*, uint32_t> addresses;
+	list<pair<uint64_t, strtree_node*> > relocations; // (loc, nodeptr)
+	vector<pair<strtree_node*, uint32_t> > addresses;
 
 	list<strtree_node*> queue;
 	queue.push_back(root);
+	child_queue children = {&out, &relocations, &queue};
 
 	// Write initial structure
 	unsigned long int processed = 0;
+	vector<uint8_t> keys;
 	while(!queue.empty()) {
-		// Write the node structure
 		strtree_node* node = queue.front();
 		queue.pop_front();
 
-		// Store leaf info
-		addresses[node] = ftell(outFile);
-		fwrite(&(node->is_leaf), 1, 1, outFile);
+		// Store leaf info and the prefix
+		addresses.push_back(make_pair(node, out.tell()));
+		out.writeInt8(node->kind | (node->is_leaf ? 0x80 : 0));
 		if(node->is_leaf)
-			writeInt32(node->value, outFile);
-		
+			out.writeInt32(node->value);
+		out.writeInt32(node->prefixLen);
+		out.write(node->prefixData(), node->prefixLen);
+
 		// Store children
-		for(int i=0;i<256;i++) {
-			strtree_node* n = node->children[i];
-			writeInt32(0, outFile); // write placeholder
-			if(n != NULL) {
-				// Add to relocation map and queue
-				relocations.push_back(make_pair(ftell(outFile), n));
-				queue.push_back(n);
+		if(node->kind == STRTREE_NODE48) {
+			out.writeInt8(node->count);
+			out.write(((strtree_node48*)node)->index, 256);
+			for(int i=0;i<node->count;i++) {
+				strtree_node* n = ((strtree_node48*)node)->children[i];
+				children(0, n);
 			}
+		} else if(node->kind == STRTREE_NODE256) {
+			strtree_node256* n256 = (strtree_node256*)node;
+			for(int b=0;b<256;b++) {
+				if(n256->children[b] != NULL) children(b, n256->children[b]);
+				else out.writeInt32(0);
+			}
+		} else {
+			keys.clear();
+			key_collector collect = {&keys};
+			eachChild(node, collect);
+			out.writeInt8(node->count);
+			out.write(keys.data(), keys.size());
+			eachChild(node, children);
 		}
 
-		printf("\rWriting strtree... %d done", ++processed);
+		if(++processed % 4096 == 0)
+			printf("\rWriting strtree... %lu done", processed);
 	}
-	putchar('\n');
+	printf("\rWriting strtree... %lu done\n", processed);
 
-	// Sort relocation pairs, then go back and rewrite location pointers
-	relocations.sort();
-	list<pair<uint32_t, strtree_node*> >::iterator i;
-	processed = 0;
+	// Fill in the location pointers. The writer applies the patches in file
+	// order when it is closed.
+	sort(addresses.begin(), addresses.end());
+	list<pair<uint64_t, strtree_node*> >::iterator i;
 	for(i=relocations.begin();i != relocations.end();i++) {
-		pair<uint32_t, strtree_node*> tmp = *i;
-		fseek(outFile, tmp.first, SEEK_SET);
-		writeInt32(addresses[tmp.second], outFile);
-		printf("\rWriting relocation data... %d done", ++processed);
+		vector<pair<strtree_node*, uint32_t> >::iterator a = lower_bound(
+				addresses.begin(), addresses.end(), make_pair(i->second, 0u));
+		out.patchInt32(i->first, a->second);
+	}
+}
+
+// Read the node at the current position of f, and everything below it
+static strtree_node* readNode(FILE* f) {
+	int flags = fgetc(f);
+	if(flags == EOF) return NULL;
+	strtree_node* node = newNode(flags & 3);
+	node->is_leaf = (flags & 0x80) != 0;
+	if(node->is_leaf) node->value = readInt32(f);
+	uint32_t prefixLen = readInt32(f);
+	if(prefixLen > (1u << 24)) {
+		deleteShell(node);
+		return NULL;
 	}
-	putchar('\n');
+	vector<uint8_t> prefix(prefixLen);
+	if(fread(prefix.data(), 1, prefixLen, f) != prefixLen) {
+		deleteShell(node);
+		return NULL;
+	}
+	setPrefix(node, prefix.data(), prefixLen);
+
+	vector<uint8_t> keys;
+	vector<uint32_t> offsets;
+	if(node->kind == STRTREE_NODE48) {
+		int count = fgetc(f);
+		strtree_node48* n48 = (strtree_node48*)node;
+		if(count == EOF || count > 48 || fread(n48->index, 1, 256, f) != 256)
+			count = 0;
+		keys.resize(count);
+		for(int b=0;b<256;b++)
+			if(n48->index[b] != 0 && n48->index[b] <= count)
+				keys[n48->index[b] - 1] = b;
+		memset(n48->index, 0, 256);
+		offsets.resize(count);
+	} else if(node->kind == STRTREE_NODE256) {
+		offsets.resize(256);
+		for(int b=0;b<256;b++) keys.push_back(b);
+	} else {
+		int count = fgetc(f);
+		int most = node->kind == STRTREE_NODE4 ? 4 : 16;
+		if(count == EOF || count > most) count = 0;
+		keys.resize(count);
+		if(fread(keys.data(), 1, count, f) != (size_t)count) keys.clear();
+		offsets.resize(keys.size());
+	}
+	offsets.resize(readInt32Array(f, offsets.data(), offsets.size()));
+
+	// A Node48's children come in slot order rather than key order, but
+	// addChild puts each one in its place whatever the order
+	for(size_t i=0;i<offsets.size();i++) {
+		if(offsets[i] == 0 || fseeko(f, offsets[i], SEEK_SET) != 0) continue;
+		strtree_node* child = readNode(f);
+		if(child != NULL) addChild(&node, keys[i], child);
+	}
+	return node;
+}
+
+strtree::strtree(FILE* f) {
+	root = readNode(f);
+	if(root == NULL) root = newNode(STRTREE_NODE4);
 }
@@ -3,22 +3,62 @@
 #include <stdint.h>
 #include <string>
 
+#include "binarywriter.hpp"
+
+/* An adaptive radix tree. Each node is one of four kinds according to how
+ * many children it has: up to 4 or 16 with sorted keys, up to 48 through a
+ * byte index, or a full table of 256. A node grows into the next kind when it
+ * fills up. Runs of single-child nodes are collapsed into a prefix held by the
+ * node below them, and any node can hold a value, since one key can be a
+ * prefix of another. */
+enum strtree_kind {
+	STRTREE_NODE4,
+	STRTREE_NODE16,
+	STRTREE_NODE48,
+	STRTREE_NODE256
+};
+
 struct strtree_node {
-	strtree_node* children[0x100];
-	uint8_t is_leaf;
+	uint8_t kind;
+	uint8_t is_leaf; // Whether the key ending here has a value
+	uint16_t count; // Children
+	uint32_t prefixLen;
 	uint32_t value;
+	union {
+		uint8_t inline_[8]; // Prefixes of up to 8 bytes are kept here
+		uint8_t* heap;
+	} prefix;
+
+	const uint8_t* prefixData() const {
+		return prefixLen <= sizeof(prefix.inline_) ? prefix.inline_ : prefix.heap;
+	}
+};
+
+struct strtree_node4 : strtree_node {
+	uint8_t keys[4];
+	strtree_node* children[4];
+};
+
+struct strtree_node16 : strtree_node {
+	uint8_t keys[16];
+	strtree_node* children[16];
+};
 
-	strtree_node();
-	~strtree_node();
+struct strtree_node48 : strtree_node {
+	uint8_t index[256]; // Slot + 1 of each byte's child, or 0
+	strtree_node* children[48];
 };
 
+struct strtree_node256 : strtree_node {
+	strtree_node* children[256];
+};
 
 class strtree {
 	strtree_node* root;
 	typedef std::basic_string<uint8_t> ustring;
 public:
 	strtree();
-	strtree(FILE* f); // Load
+	strtree(FILE* f); // Load what serialize() wrote, from the current position
 	~strtree();
 
 	// Accessors
@@ -27,5 +67,11 @@ public:
 	uint32_t get(ustring s);
 
 	// Serialization
-	void serialize(FILE* outFile);
+	void serialize(BinaryWriter& out);
+
+private:
+	const strtree_node* find(const ustring& s) const;
+
+	strtree(const strtree&);
+	strtree& operator=(const strtree&);
 };
@@ -0,0 +1,37 @@
+#pragma once
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// Reduce a page title or link target to the form used as a lookup key: the
+// section anchor is dropped, underscores become spaces, surrounding
+// whitespace is trimmed and ASCII letters are lower-cased. Page titles and
+// link targets must both go through this so that they meet in the middle.
+inline void normalizeTitle(const char* s, size_t len, std::string& out) {
+	out.clear();
+	for(size_t i=0;i<len && s[i] != '#';i++) {
+		unsigned char c = s[i];
+		if(c == '_') c = ' ';
+		if(isspace(c) && out.empty()) continue;
+		out.push_back(tolower(c));
+	}
+	size_t end = out.find_last_not_of(" \t\r\n");
+	out.resize(end == std::string::npos ? 0 : end+1);
+}
+
+// 64-bit hash of a normalized title, for places that match titles by hash
+// rather than by string. FNV-1a followed by a final avalanche step.
+inline uint64_t titleHash(const char* s, size_t len) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for(size_t i=0;i<len;i++) {
+		h ^= (unsigned char)s[i];
+		h *= 0x100000001b3ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
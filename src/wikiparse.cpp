@@ -1,6 +1,7 @@
-#include "linklist.hpp"
+#include "appendvector.hpp"
 #include "bytes.hpp"
 #include "rbt.hpp"
+#include "contentstore.hpp"
 #include <utility>
 #include <vector>
 #include <string>
@@ -13,9 +14,13 @@
 
 #include <list>
 #include <map>
+#include <unordered_map>
 #include <algorithm>
 
 #include <boost/regex.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
 
 #include <libxml/xmlstring.h>
 #include <libxml/parser.h>
@@ -27,7 +32,7 @@ using namespace std;
  * Emits:
  *	ids.bin		- Serialized binary tree mapping page names to ID numbers
  *	names.bin	- Vector of page IDs mapping to names
- *	contents.bin	- Maps pages to their content text using a skip list
+ *	contents.bin	- Page text in compressed blocks (see contentstore.hpp)
  *	links.bin	- Maps page IDs to the textual links they contain
  */
  
@@ -67,48 +72,11 @@ struct Page {
 	int wikiID;
 	bool isRedirect;
 	bool fullyResolved;
+	uint32_t nUnresolved; // Links still waiting for their target
 	string target;
 	LinkList links;
 };
 
-// Writes an 8-level skip list of content pages
-class ContentWriter {
-public:
-	ContentWriter(const char* fname) {
-		fptr = fopen(fname, "wb");
-	}
-
-	~ContentWriter() {
-		fclose(fptr);
-	}
-
-	void addEntry(string content) {
-		// Get our address
-		written++;
-		uint64_t addr = ftell(fptr);
-
-		// Check the link queue
-		if(linkingQueue.count(written) > 0) {
-			pair<multimap<uint32_t,size_t>::iterator,multimap<uint32_t,size_t>::iterator> itrs = linkingQueue.equal_range(written);
-		}
-
-		// Write the content
-	}
-
-private:
-	void seekWrite(size_t pos, uint64_t value, bool restore=true) {
-		size_t oldp = ftell(fptr);
-		fseek(fptr, pos, SEEK_SET);
-		value = swap64(value);
-		fwrite(&value, sizeof(value), 1, fptr);
-		if(restore) fseek(fptr, oldp, SEEK_SET);
-	}
-
-	FILE* fptr;
-	uint32_t written;
-	multimap<uint32_t, size_t> linkingQueue; // Maps written values to the addresses at which to write the coords
-};
-
 struct parsingStackElement {
 	StackElementType type;
 	string str;
@@ -119,7 +87,7 @@ struct parsingStackElement {
 };
 
 struct parsingState {
-	parsingState() {
+	parsingState() : handoff(4096) {
 		id=0;
 		insns.push_back(SI_PAGE);
 		tagContent = "";
@@ -136,10 +104,14 @@ struct parsingState {
 	bool err;
 	string errMsg;
 
-	// Output queue
-	map<string, uint32_t> namesIDs;
-	vector<vector<string> > idsLinks;
+	// Finished pages go from the parser to the resolver through here. There
+	// is exactly one of each, so a single-producer queue needs no locks.
+	boost::lockfree::spsc_queue<Page*> handoff;
 	uint32_t nParsed;
+
+	// Owned by the resolver: pages in ID order and the IDs of their titles
+	append_vector<Page*> finalPages;
+	map<string, uint32_t> nameMapping;
 };
 
 void printStack(parsingState* st) {
@@ -371,14 +343,10 @@ void saxStartElem(void* ctx, const xmlChar* fullname, const xmlChar** attrs) {
 				}
 				Page* p = (Page*)(pr->stack.back().object);
 
-				// Assign an ID
-				uint32_t pID = pr->idsLinks.size();
-
-				// Add to data structures
-				pr->idsLinks.push_back(p->links);
-				pr->namesIDs[p->title] = pID;
+				// Hand the page to the resolver, which assigns its ID. If
+				// the resolver has fallen behind, wait for it.
+				while(!pr->handoff.push(p)) this_thread::yield();
 
-				// Append to the content map
 				if(pr->nParsed++ % 1024 == 0) {
 					printf("\rParsing XML dump... [%d records done]", pr->nParsed);
 					fflush(stdout);
@@ -446,48 +414,73 @@ void saxError(void* ctx, const char* msg, ...) {
 	va_end(args);
 }
 
-void linkResolver(parsingState* st, bool& term) {
-	bool didResolve = false;
-	bool didRegister = false;
-	while((!term) || didResolve) {
-		// Iterate through finalPages and try to resolve links
-		uint32_t ident = 0;
-		didResolve = false;
-		didRegister = false;
-		printf("Got work\n");
-		for(synclist<Page*>::iterator i=st->finalPages.begin();i != st->finalPages.end();ident++,++i) {
-			Page* p = *i;
-			// Add the page to the name mapping
-			if(st->nameMapping.find(p->title) == st->nameMapping.end()) {
-				st->nameMapping[p->title] = ident;
-				didRegister = true;
-			}
+struct pendingLink {
+	Page* page;
+	uint32_t link;
+};
 
-			// Try to resolve the page's links
-			if(p->fullyResolved) continue;
-			bool hasUnresolved = false;
-			didResolve = true;
-			for(LinkList::iterator j=p->links.begin();j != p->links.end();j++) {
-				Link& l = *j;
-				if(l.resolved) continue;
-				// Try to resolve the name
-				map<string,uint32_t>::iterator nitr = st->nameMapping.find(*l.target);
-				if(nitr != st->nameMapping.end()) {
-					// We found the page, so adjust the link
-					l.ident = nitr->second;
-					l.resolved = true;
-					printf("Resolved\n");
-					delete l.target;
-				} else {
-					hasUnresolved = true;
+static void resolveLink(Page* p, Link& l, uint32_t ident) {
+	delete l.target;
+	l.ident = ident;
+	l.resolved = true;
+	if(--p->nUnresolved == 0) p->fullyResolved = true;
+}
+
+/* Assigns IDs to pages as the parser hands them over, and resolves links to
+ * them. A link whose target hasn't been seen yet waits on the target's name,
+ * and registering that name resolves exactly its waiters, so every link is
+ * looked at once or twice however the pages are ordered. */
+void linkResolver(parsingState* st, boost::atomic<bool>* parsingDone) {
+	unordered_map<string, vector<pendingLink> > waiting;
+	while(true) {
+		// The flag is read before popping: the parser sets it after handing
+		// over its last page, so if it was set and the queue is empty then,
+		// nothing more is coming
+		bool done = parsingDone->load(boost::memory_order_acquire);
+		Page* p;
+		if(!st->handoff.pop(p)) {
+			if(done) break;
+			this_thread::yield();
+			continue;
+		}
+
+		uint32_t ident = st->finalPages.push_back(p);
+		if(st->nameMapping.insert(make_pair(p->title, ident)).second) {
+			// Wake the links that were waiting for this title
+			unordered_map<string, vector<pendingLink> >::iterator w =
+				waiting.find(p->title);
+			if(w != waiting.end()) {
+				vector<pendingLink>& pending = w->second;
+				for(size_t i=0;i<pending.size();i++) {
+					Page* from = pending[i].page;
+					resolveLink(from, from->links[pending[i].link], ident);
 				}
+				waiting.erase(w);
+			}
+		}
+
+		// Resolve this page's links, or leave them waiting. A page, redirect
+		// or not, is fully resolved once it has no links left waiting.
+		p->nUnresolved = p->links.size();
+		p->fullyResolved = p->nUnresolved == 0;
+		for(uint32_t i=0;i<p->links.size();i++) {
+			Link& l = p->links[i];
+			map<string,uint32_t>::iterator nitr = st->nameMapping.find(*l.target);
+			if(nitr != st->nameMapping.end()) {
+				resolveLink(p, l, nitr->second);
+			} else {
+				pendingLink pl = {p, i};
+				waiting[*l.target].push_back(pl);
 			}
-			if(!hasUnresolved) p->fullyResolved = true;
 		}
-		if((!didRegister) && (!didResolve) && term) break;
-		this_thread::sleep_for(chrono::seconds(2));
 	}
-	printf("Resolver terminating\n");
+
+	size_t unresolved = 0;
+	for(unordered_map<string, vector<pendingLink> >::iterator i=waiting.begin();
+			i != waiting.end();i++)
+		unresolved += i->second.size();
+	printf("Resolver terminating, %lu links to missing pages\n",
+			(unsigned long)unresolved);
 }
 
 int main(int argc, char **argv) {
@@ -506,22 +499,22 @@ int main(int argc, char **argv) {
 	handler.error = &saxError;
 	
 	// And parse
-	bool parsingDone = false;
-	thread resolver(linkResolver, &parseRes, ref(parsingDone));
+	boost::atomic<bool> parsingDone(false);
+	thread resolver(linkResolver, &parseRes, &parsingDone);
 	int res = xmlSAXUserParseFile(&handler, &parseRes, fname);
 	if(res != 0) {
 		fres.rc = 1;
 		fres.errMsg = "Failed to parse XML";
 		return fres;
 	}
-	parsingDone = true;
+	parsingDone.store(true, boost::memory_order_release);
 	printf("\nXML parsing complete. Waiting for link resolution...");
 	resolver.join();
 	printf("Done\nParsing complete\n");
 
 	// TEMPORARY FOR MEMORY OPTIMIZATION
 	printf("Length: %d\n", parseRes.finalPages.size());
-	for(synclist<Page*>::iterator i=parseRes.finalPages.begin();i != parseRes.finalPages.end();++i) {
+	for(append_vector<Page*>::iterator i=parseRes.finalPages.begin();i != parseRes.finalPages.end();++i) {
 		//printf("Page:\n\tTitle: %s\n\tLinks:\n", (*i)->title.c_str());
 		for(LinkList::iterator j=(*i)->links.begin();j != (*i)->links.end();j++) {
 			if(j->resolved) {
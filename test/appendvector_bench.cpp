@@ -0,0 +1,98 @@
+// Throughput of append_vector against the two obvious alternatives: a node
+// per element linked through an atomic tail, as synclist did, and a vector
+// behind a mutex.
+//
+// Usage: appendvector_bench [writers] [pushes per writer]
+
+#include "appendvector.hpp"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/chrono.hpp>
+
+using namespace std;
+
+// Appends by swapping in a new tail and then linking the old one to it
+class node_list {
+	struct node {
+		uint64_t value;
+		boost::atomic<node*> next;
+	};
+
+	node m_head;
+	boost::atomic<node*> m_tail;
+
+public:
+	node_list() : m_tail(&m_head) {
+		m_head.next.store(NULL);
+	}
+
+	~node_list() {
+		node* n = m_head.next.load();
+		while(n != NULL) {
+			node* next = n->next.load();
+			delete n;
+			n = next;
+		}
+	}
+
+	void push_back(uint64_t value) {
+		node* n = new node();
+		n->value = value;
+		n->next.store(NULL, boost::memory_order_relaxed);
+		node* prev = m_tail.exchange(n, boost::memory_order_acq_rel);
+		prev->next.store(n, boost::memory_order_release);
+	}
+};
+
+class locked_vector {
+	boost::mutex m_lock;
+	vector<uint64_t> m_v;
+
+public:
+	void push_back(uint64_t value) {
+		boost::lock_guard<boost::mutex> l(m_lock);
+		m_v.push_back(value);
+	}
+};
+
+template<typename V>
+static void pushes(V* v, uint64_t n) {
+	for(uint64_t i=0;i<n;i++) v->push_back(i);
+}
+
+template<typename V>
+static void run(const char* name, unsigned writers, uint64_t n) {
+	boost::chrono::steady_clock::time_point start =
+		boost::chrono::steady_clock::now();
+	{
+		V v;
+		vector<boost::thread*> threads;
+		for(unsigned w=0;w<writers;w++)
+			threads.push_back(new boost::thread(pushes<V>, &v, n));
+		for(size_t i=0;i<threads.size();i++) {
+			threads[i]->join();
+			delete threads[i];
+		}
+	}
+	double ms = boost::chrono::duration<double, boost::milli>(
+			boost::chrono::steady_clock::now() - start).count();
+	printf("%-14s %8.1f ms  %6.1f M pushes/s\n", name, ms,
+			writers * n / ms / 1000);
+}
+
+int main(int argc, char** argv) {
+	unsigned writers = argc > 1 ? atoi(argv[1]) : 4;
+	uint64_t n = argc > 2 ? atoll(argv[2]) : 2000000;
+	printf("%u writers, %llu pushes each, including freeing\n", writers,
+			(unsigned long long)n);
+	run<append_vector<uint64_t> >("append_vector", writers, n);
+	run<node_list>("node list", writers, n);
+	run<locked_vector>("locked vector", writers, n);
+	return 0;
+}
@@ -0,0 +1,116 @@
+// Stress test for append_vector: several writers push tagged values while
+// readers scan everything below size(). Meant to be run under ThreadSanitizer
+// too, by building with -DCMAKE_CXX_FLAGS=-fsanitize=thread.
+//
+// Usage: appendvector_test [writers] [pushes per writer] [readers]
+
+#include "appendvector.hpp"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+// A value holds its writer in the top bits and its sequence number in the
+// rest, counting from 1, so a default-constructed 0 is never a real value
+static const unsigned WRITER_SHIFT = 40;
+
+struct test_state {
+	append_vector<uint64_t> v;
+	unsigned writers;
+	uint64_t pushes;
+	boost::atomic<unsigned> running;
+	boost::atomic<bool> failed;
+};
+
+static void fail(test_state* st, const char* msg, size_t i, uint64_t value) {
+	if(!st->failed.exchange(true))
+		fprintf(stderr, "%s at %zu: writer %llu, value %llu\n", msg, i,
+				(unsigned long long)(value >> WRITER_SHIFT),
+				(unsigned long long)(value & ((1ull << WRITER_SHIFT) - 1)));
+}
+
+static void writer(test_state* st, unsigned w) {
+	for(uint64_t n=1;n<=st->pushes;n++) {
+		uint64_t value = ((uint64_t)w << WRITER_SHIFT) | n;
+		size_t i = st->v.push_back(value);
+		if(st->v[i] != value) fail(st, "Element changed", i, st->v[i]);
+	}
+	st->running--;
+}
+
+// Everything below size() must be complete, and each writer's values must
+// show up in the order they were pushed. Elements never change once they
+// are below size(), so each pass only reads the new ones.
+static void reader(test_state* st) {
+	vector<uint64_t> last(st->writers, 0);
+	size_t seen = 0;
+	while(!st->failed) {
+		bool finished = st->running == 0;
+		size_t size = st->v.size();
+		if(size < seen) fail(st, "Size went backwards", size, 0);
+		for(size_t i=seen;i<size;i++) {
+			uint64_t value = st->v[i];
+			unsigned w = value >> WRITER_SHIFT;
+			uint64_t n = value & ((1ull << WRITER_SHIFT) - 1);
+			if(n == 0 || w >= st->writers) {
+				fail(st, "Unwritten element below size()", i, value);
+				return;
+			}
+			if(n <= last[w]) {
+				fail(st, "Out of order", i, value);
+				return;
+			}
+			last[w] = n;
+		}
+		seen = size;
+		if(finished) break;
+	}
+}
+
+int main(int argc, char** argv) {
+	test_state st;
+	st.writers = argc > 1 ? atoi(argv[1]) : 4;
+	st.pushes = argc > 2 ? atoll(argv[2]) : 500000;
+	unsigned readers = argc > 3 ? atoi(argv[3]) : 2;
+	st.running = st.writers;
+	st.failed = false;
+
+	vector<boost::thread*> threads;
+	for(unsigned i=0;i<readers;i++)
+		threads.push_back(new boost::thread(reader, &st));
+	for(unsigned w=0;w<st.writers;w++)
+		threads.push_back(new boost::thread(writer, &st, w));
+	for(size_t i=0;i<threads.size();i++) {
+		threads[i]->join();
+		delete threads[i];
+	}
+
+	if(st.failed) return 1;
+
+	// Every value must be there exactly once
+	uint64_t total = st.writers * st.pushes;
+	if(st.v.size() != total) {
+		fprintf(stderr, "%zu values, expected %llu\n", st.v.size(),
+				(unsigned long long)total);
+		return 1;
+	}
+	vector<uint64_t> count(st.writers, 0);
+	for(append_vector<uint64_t>::iterator i=st.v.begin();i != st.v.end();++i)
+		count[*i >> WRITER_SHIFT]++;
+	for(unsigned w=0;w<st.writers;w++) {
+		if(count[w] != st.pushes) {
+			fprintf(stderr, "Writer %u has %llu values\n", w,
+					(unsigned long long)count[w]);
+			return 1;
+		}
+	}
+	printf("%u writers pushed %llu values with %u readers watching\n",
+			st.writers, (unsigned long long)total, readers);
+	return 0;
+}
@@ -0,0 +1,116 @@
+// Checks that scanLinks() finds exactly what the link regex it replaced finds,
+// on random strings and on the text of a dump.
+//
+// Usage: linkscan_test [dump.xml | dump.xml.bz2]...
+
+#include "linkscan.hpp"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include <boost/regex.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/bzip2.hpp>
+
+using namespace std;
+namespace io = boost::iostreams;
+
+// The pattern preprocess used before it had a scanner
+static const boost::regex linkRE("\\[\\[([^|\\]]+)(\\|[^\\]]+)?\\]\\]",
+		boost::regex::perl);
+
+static void regexLinks(const string& text, vector<link_span>& out) {
+	boost::sregex_iterator iter(text.begin(), text.end(), linkRE);
+	boost::sregex_iterator endIter;
+	for(;iter != endIter;++iter) {
+		link_span l;
+		l.offset = (*iter)[1].first - text.begin();
+		l.length = (*iter)[1].length();
+		out.push_back(l);
+	}
+}
+
+static void printSpans(const string& text, const vector<link_span>& spans) {
+	for(size_t i=0;i<spans.size();i++)
+		fprintf(stderr, "  %u+%u \"%s\"\n", spans[i].offset, spans[i].length,
+				text.substr(spans[i].offset, spans[i].length).c_str());
+}
+
+// Compare the two on one piece of text, printing it if they differ
+static bool check(const string& text, const char* what) {
+	vector<link_span> want, got;
+	regexLinks(text, want);
+	scanLinks(text.data(), text.size(), got);
+	bool same = want.size() == got.size();
+	for(size_t i=0;same && i<want.size();i++)
+		same = want[i].offset == got[i].offset &&
+			want[i].length == got[i].length;
+	if(!same) {
+		fprintf(stderr, "Mismatch in %s:\n%s\nregex:\n", what, text.c_str());
+		printSpans(text, want);
+		fprintf(stderr, "scanLinks:\n");
+		printSpans(text, got);
+	}
+	return same;
+}
+
+// Strings made mostly of the characters the scanner cares about, with
+// lengths that cross the 16 byte blocks it compares
+static bool checkRandom(unsigned count) {
+	static const char alphabet[] = "[]|ab\n ";
+	uint64_t x = 88172645463325252ull;
+	string s;
+	for(unsigned n=0;n<count;n++) {
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+		size_t len = x % 80;
+		s.clear();
+		for(size_t i=0;i<len;i++) {
+			x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+			s += alphabet[x % (sizeof(alphabet) - 1)];
+		}
+		if(!check(s, "a random string")) return false;
+	}
+	printf("%u random strings match\n", count);
+	return true;
+}
+
+// Compare the two over a dump, a megabyte at a time. Links cut at the edge of
+// a piece are cut the same way for both.
+static bool checkDump(const char* path) {
+	ifstream file(path, ios_base::in | ios_base::binary);
+	if(!file) {
+		fprintf(stderr, "Cannot open %s\n", path);
+		return false;
+	}
+	io::filtering_istream in;
+	size_t len = strlen(path);
+	if(len > 4 && strcmp(path + len - 4, ".bz2") == 0)
+		in.push(io::bzip2_decompressor());
+	in.push(file);
+
+	vector<char> buf(1<<20);
+	uint64_t bytes = 0, links = 0;
+	while(in) {
+		in.read(&buf[0], buf.size());
+		string text(&buf[0], in.gcount());
+		if(text.empty()) break;
+		if(!check(text, path)) return false;
+		vector<link_span> spans;
+		scanLinks(text.data(), text.size(), spans);
+		bytes += text.size();
+		links += spans.size();
+	}
+	printf("%s: %llu links in %llu bytes match\n", path,
+			(unsigned long long)links, (unsigned long long)bytes);
+	return true;
+}
+
+int main(int argc, char** argv) {
+	bool ok = checkRandom(300000);
+	for(int i=1;i<argc;i++) ok = checkDump(argv[i]) && ok;
+	return ok ? 0 : 1;
+}
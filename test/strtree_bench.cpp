@@ -0,0 +1,213 @@
+// Memory, size and speed of strtree against the tree it replaced, which gave
+// every node a table of 256 child pointers
+//
+// Usage: strtree_bench [keys] [file with one key per line]
+
+#include "strtree.hpp"
+#include "binarywriter.hpp"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <boost/chrono.hpp>
+
+using namespace std;
+typedef basic_string<uint8_t> ustring;
+typedef boost::chrono::steady_clock bench_clock;
+
+// The old layout, enough of it to build and search
+struct flat_node {
+	flat_node* children[0x100];
+	uint8_t is_leaf;
+	uint32_t value;
+
+	flat_node() : is_leaf(false) {
+		memset(children, 0, sizeof(children));
+	}
+
+	~flat_node() {
+		for(int i=0;i<256;i++) delete children[i];
+	}
+};
+
+struct flat_tree {
+	flat_node root;
+	size_t nodes, leaves;
+
+	flat_tree() : nodes(1), leaves(0) {
+	}
+
+	void set(const ustring& s, uint32_t v) {
+		flat_node* node = &root;
+		for(size_t i=0;i<s.length();i++) {
+			if(node->children[s[i]] == NULL) {
+				node->children[s[i]] = new flat_node();
+				nodes++;
+			}
+			node = node->children[s[i]];
+		}
+		if(!node->is_leaf) leaves++;
+		node->is_leaf = true;
+		node->value = v;
+	}
+
+	uint32_t get(const ustring& s) const {
+		const flat_node* node = &root;
+		for(size_t i=0;node != NULL && i<s.length();i++)
+			node = node->children[s[i]];
+		return node == NULL || !node->is_leaf ? 0 : node->value;
+	}
+
+	// What its serialize() wrote: a flag byte, the value of a leaf and a
+	// placeholder for every possible child
+	uint64_t serializedSize() const {
+		return nodes * (1 + 4*256) + leaves * 4;
+	}
+};
+
+static uint64_t rng = 88172645463325252ull;
+
+static uint64_t next() {
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+// Title-like keys, lower case as the databases keep them
+static void makeKeys(size_t count, vector<ustring>& keys) {
+	static const char* syllables[] = {"ka", "lo", "mi", "ne", "ra", "to",
+		"su", "vi", "an", "el", "or", "is", "um", "et", "ba", "de"};
+	static const char* forms[] = {"%s", "%s %s", "%s (film)", "list of %s",
+		"history of %s", "%s, %s", "the %s", "%s %s station"};
+	vector<ustring> made;
+	while(made.size() < count) {
+		for(size_t i=made.size();i<count;i++) {
+			char w[2][32];
+			for(int j=0;j<2;j++) {
+				w[j][0] = '\0';
+				for(int s=1+next()%5;s>0;s--)
+					strcat(w[j], syllables[next() % 16]);
+			}
+			char key[128];
+			snprintf(key, sizeof(key), forms[next() % 8], w[0], w[1]);
+			made.push_back(ustring((const uint8_t*)key, strlen(key)));
+		}
+		sort(made.begin(), made.end());
+		made.erase(unique(made.begin(), made.end()), made.end());
+	}
+	for(size_t i=0;i<made.size();i++) swap(made[i], made[next() % (i+1)]);
+	keys.swap(made);
+}
+
+static bool readKeys(const char* path, size_t count, vector<ustring>& keys) {
+	FILE* f = fopen(path, "r");
+	if(f == NULL) return false;
+	char line[0x10000];
+	while(keys.size() < count && fgets(line, sizeof(line), f) != NULL) {
+		size_t len = strcspn(line, "\r\n");
+		keys.push_back(ustring((const uint8_t*)line, len));
+	}
+	fclose(f);
+	return true;
+}
+
+static size_t heapUsed() {
+	return mallinfo2().uordblks;
+}
+
+static double msSince(bench_clock::time_point start) {
+	return boost::chrono::duration<double, boost::milli>(
+			bench_clock::now() - start).count();
+}
+
+// Half the probes are keys and half are keys with a byte added at the end
+static void makeProbes(const vector<ustring>& keys, vector<ustring>& probes) {
+	for(size_t i=0;i<keys.size();i++) {
+		probes.push_back(keys[i]);
+		ustring miss = keys[i];
+		miss.push_back('~');
+		probes.push_back(miss);
+	}
+	for(size_t i=0;i<probes.size();i++)
+		swap(probes[i], probes[next() % (i+1)]);
+}
+
+template<typename T>
+static double lookupNs(T& tree, const vector<ustring>& probes,
+		uint64_t& found) {
+	bench_clock::time_point start = bench_clock::now();
+	for(int round=0;round<3;round++)
+		for(size_t i=0;i<probes.size();i++) found += tree.get(probes[i]) != 0;
+	return msSince(start) * 1e6 / (3 * probes.size());
+}
+
+int main(int argc, char** argv) {
+	size_t count = argc > 1 ? atoi(argv[1]) : 100000;
+	vector<ustring> keys, probes;
+	if(argc > 2) {
+		if(!readKeys(argv[2], count, keys)) {
+			fprintf(stderr, "Cannot open %s\n", argv[2]);
+			return 1;
+		}
+	} else {
+		makeKeys(count, keys);
+	}
+	makeProbes(keys, probes);
+	printf("%zu keys\n", keys.size());
+	printf("%-10s %10s %12s %10s %10s\n", "tree", "heap MB", "file MB",
+			"insert ms", "lookup ns");
+	uint64_t found = 0;
+
+	{
+		size_t before = heapUsed();
+		bench_clock::time_point start = bench_clock::now();
+		strtree* t = new strtree();
+		for(size_t i=0;i<keys.size();i++) t->set(keys[i], i + 1);
+		double insert = msSince(start);
+		size_t heap = heapUsed() - before;
+		double lookup = lookupNs(*t, probes, found);
+
+		char path[] = "/tmp/strtree_bench.XXXXXX";
+		int fd = mkstemp(path);
+		close(fd);
+		BinaryWriter out;
+		struct stat st;
+		st.st_size = 0;
+		if(out.open(path)) {
+			t->serialize(out);
+			out.close();
+			stat(path, &st);
+		}
+		remove(path);
+		printf("%-10s %10.1f %12.1f %10.1f %10.1f\n", "adaptive",
+				heap / 1048576.0, st.st_size / 1048576.0, insert, lookup);
+		delete t;
+	}
+
+	// The old tree takes about 2KB a node, so stop before it runs away
+	if(keys.size() > 200000) {
+		printf("Skipping the 256-pointer tree for more than 200000 keys\n");
+	} else {
+		size_t before = heapUsed();
+		bench_clock::time_point start = bench_clock::now();
+		flat_tree* t = new flat_tree();
+		for(size_t i=0;i<keys.size();i++) t->set(keys[i], i + 1);
+		double insert = msSince(start);
+		size_t heap = heapUsed() - before;
+		double lookup = lookupNs(*t, probes, found);
+		printf("%-10s %10.1f %12.1f %10.1f %10.1f\n", "256-way",
+				heap / 1048576.0, t->serializedSize() / 1048576.0, insert,
+				lookup);
+		delete t;
+	}
+	return found == 0;
+}
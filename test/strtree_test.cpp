@@ -0,0 +1,128 @@
+// Checks strtree lookups, and that a tree reads back the same after a
+// serialize and load round trip
+//
+// Usage: strtree_test [keys]
+
+#include "strtree.hpp"
+#include "binarywriter.hpp"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+typedef basic_string<uint8_t> ustring;
+
+static uint64_t rng = 88172645463325252ull;
+
+static uint64_t next() {
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+// Title-like keys sharing prefixes of various lengths, plus the cases that
+// push nodes through every kind: a key that is a prefix of others, long
+// shared prefixes, and a node with a child for every byte
+static void makeKeys(size_t count, map<ustring, uint32_t>& keys) {
+	static const char* words[] = {"list of ", "history of ", "the ", "album",
+		"river ", "(film)", "a", "b", "c", "station", "1998 in ", "z"};
+	ustring k;
+	keys[k] = 1;
+	for(int b=0;b<256;b++) {
+		k.assign(1, (uint8_t)b);
+		keys[k] = 2 + b;
+		k.append((const uint8_t*)"same long shared prefix ", 24);
+		keys[k] = 300 + b;
+	}
+	while(keys.size() < count) {
+		k.clear();
+		size_t parts = 1 + next() % 4;
+		for(size_t i=0;i<parts;i++) {
+			const char* w = words[next() % (sizeof(words)/sizeof(words[0]))];
+			k.append((const uint8_t*)w, strlen(w));
+		}
+		if(next() % 2) {
+			char n[16];
+			snprintf(n, sizeof(n), " %u", (unsigned)(next() % 10000));
+			k.append((const uint8_t*)n, strlen(n));
+		}
+		keys[k] = 1000 + keys.size();
+	}
+}
+
+static bool check(strtree& t, const map<ustring, uint32_t>& keys,
+		const char* what) {
+	for(map<ustring, uint32_t>::const_iterator i=keys.begin();
+			i != keys.end();i++) {
+		if(!t.has(i->first) || t.get(i->first) != i->second) {
+			fprintf(stderr, "%s: key \"%s\" reads %u, expected %u\n", what,
+					(const char*)i->first.c_str(), t.get(i->first), i->second);
+			return false;
+		}
+
+		// Prefixes and extensions of a key are misses unless they're keys
+		ustring miss = i->first;
+		miss.push_back('#');
+		for(int cut=0;cut<2;cut++) {
+			if(keys.count(miss) == 0 && (t.has(miss) || t.get(miss) != 0)) {
+				fprintf(stderr, "%s: \"%s\" should be missing\n", what,
+						(const char*)miss.c_str());
+				return false;
+			}
+			if(i->first.empty()) break;
+			miss = i->first.substr(0, i->first.length() - 1);
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	size_t count = argc > 1 ? atoi(argv[1]) : 50000;
+	map<ustring, uint32_t> keys;
+	makeKeys(count, keys);
+
+	strtree t;
+	for(map<ustring, uint32_t>::iterator i=keys.begin();i != keys.end();i++)
+		t.set(i->first, i->second + 1);
+	for(map<ustring, uint32_t>::iterator i=keys.begin();i != keys.end();i++)
+		t.set(i->first, i->second); // Setting a key again replaces its value
+	if(!check(t, keys, "built")) return 1;
+
+	char path[] = "/tmp/strtree_test.XXXXXX";
+	int fd = mkstemp(path);
+	if(fd < 0) {
+		fprintf(stderr, "Cannot create a temporary file\n");
+		return 1;
+	}
+	close(fd);
+	BinaryWriter out;
+	if(!out.open(path)) {
+		fprintf(stderr, "Cannot open %s\n", path);
+		return 1;
+	}
+	t.serialize(out);
+	if(!out.close()) {
+		fprintf(stderr, "Error writing %s\n", path);
+		return 1;
+	}
+
+	FILE* f = fopen(path, "rb");
+	if(f == NULL) {
+		fprintf(stderr, "Cannot reopen %s\n", path);
+		return 1;
+	}
+	strtree loaded(f);
+	fclose(f);
+	remove(path);
+	if(!check(loaded, keys, "loaded")) return 1;
+	printf("%zu keys and their near misses read back the same\n",
+			keys.size());
+	return 0;
+}